@@ -0,0 +1,134 @@
+/*
+* DmxIngest.cpp - Common ingest stage for the E1.31, DDP and ZCPP receivers
+*
+* author: Andrew Williams (LabRat)
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*/
+
+#include "DmxIngest.h"
+
+void DmxIngest::begin(WnrfDriver *driver, uint16_t channels, uint8_t streams) {
+    _driver   = driver;
+    _channels = channels;
+    _streams  = 0;
+
+    if (_seq) free(_seq);
+    if ((_seq = static_cast<uint8_t *>(malloc(streams)))) {
+        memset(_seq, 0x00, streams);
+        _streams = streams;
+    }
+    _ddp_seq  = 0;
+    _zcpp_seq = 0;
+
+    resetStats();
+}
+
+void DmxIngest::resetStats(void) {
+    memset(_stats, 0x00, sizeof(_stats));
+}
+
+/*
+ * Sequence rules differ per protocol:
+ *   E1.31 - 8 bit, steps once per packet, tracked per universe
+ *   DDP   - 4 bit, 1..15 then back to 1, 0 means not in use
+ *   ZCPP  - 8 bit, shared by the packets of a frame, steps per frame
+ */
+void DmxIngest::checkSeq(IngestSrc src, uint8_t stream, uint8_t seq, uint8_t flags) {
+    ingest_stats_t *stats = &_stats[static_cast<uint8_t>(src)];
+    uint8_t expect;
+    uint8_t gap = 0;
+
+    switch (src) {
+        case IngestSrc::E131:
+            if (stream >= _streams) return;
+            expect = _seq[stream];
+            _seq[stream] = seq + 1;
+            if (seq == expect) return;
+            gap = seq - expect;
+            break;
+
+        case IngestSrc::DDP:
+            expect = (_ddp_seq == 15) ? 1 : _ddp_seq + 1;
+            if (!_ddp_seq || (seq == expect)) {
+                _ddp_seq = seq;
+                return;
+            }
+            _ddp_seq = seq;
+            stats->seq_errors++;
+            stats->lost += (seq + 15 - expect) % 15;
+            return;
+
+        case IngestSrc::ZCPP:
+            expect = _zcpp_seq;
+            _zcpp_seq = (flags & INGEST_EOF) ? seq + 1 : seq;
+            if (seq == expect) return;
+            gap = seq - expect;
+            break;
+
+        default:
+            return;
+    }
+
+    Serial.print(F("Sequence Error - expected: "));
+    Serial.print(expect);
+    Serial.print(F(" actual: "));
+    Serial.print(seq);
+    Serial.print(F(" stream: "));
+    Serial.println(stream);
+
+    stats->seq_errors++;
+    if (gap < 128) stats->lost += gap; // Otherwise late or repeated
+}
+
+void DmxIngest::feed(IngestSrc src, uint8_t stream, int32_t offset,
+                     const uint8_t *data, uint16_t len, uint8_t seq, uint8_t flags) {
+    ingest_stats_t *stats = &_stats[static_cast<uint8_t>(src)];
+
+    stats->packets++;
+    stats->last_seen = millis();
+
+    if (flags & INGEST_SEQ)
+        checkSeq(src, stream, seq, flags);
+
+    // Data ahead of the first channel we listen to is skipped
+    if (offset < 0) {
+        if (-offset >= len) {
+            len = 0;
+        } else {
+            data += -offset;
+            len  -= -offset;
+        }
+        offset = 0;
+    }
+
+    if (offset >= _channels) {
+        stats->clipped += len;
+        len = 0;
+    } else if (len > _channels - offset) {
+        stats->clipped += len - (_channels - offset);
+        len = _channels - offset;
+    }
+
+    if (len && _driver) {
+        _driver->setRange(offset, data, len);
+        stats->channels += len;
+    }
+
+    if (flags & INGEST_COMMIT)
+        commit(src);
+}
+
+void DmxIngest::commit(IngestSrc src) {
+    _stats[static_cast<uint8_t>(src)].frames++;
+    if (_driver) _driver->commit();
+}
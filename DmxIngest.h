@@ -0,0 +1,83 @@
+/*
+* DmxIngest.h - Common ingest stage for the E1.31, DDP and ZCPP receivers
+*
+* author: Andrew Williams (LabRat)
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*
+* Each protocol works out where its payload lands in the output (offset),
+* then hands it over as (offset, data, length, sequence, flags). From there
+* bounds checking, the bulk copy into the driver, sequence/loss accounting
+* and the end of frame are handled here, the same way for every protocol.
+*/
+
+#ifndef DMXINGEST_H_
+#define DMXINGEST_H_
+
+#include <Arduino.h>
+#include "WnrfDriver.h"
+
+enum class IngestSrc : uint8_t {
+    E131,
+    DDP,
+    ZCPP,
+    COUNT
+};
+
+// feed() flags
+#define INGEST_SEQ    (0x01)  // Sequence number is valid
+#define INGEST_EOF    (0x02)  // Last packet of the sender's frame
+#define INGEST_COMMIT (0x04)  // Frame complete, hand it to the radio
+
+typedef struct {
+    uint32_t packets;     // Data packets ingested
+    uint32_t channels;    // Channel values copied to the output
+    uint32_t clipped;     // Channel values beyond the output, dropped
+    uint32_t seq_errors;  // Sequence discontinuities
+    uint32_t lost;        // Packets (ZCPP: frames) missing from the gaps
+    uint32_t frames;      // Frames committed to the radio
+    uint32_t last_seen;   // millis() of the last packet
+} ingest_stats_t;
+
+class DmxIngest {
+ public:
+    DmxIngest() : _driver(NULL), _seq(NULL) {}
+
+    /* Output size in channels, streams = E1.31 universes being tracked */
+    void begin(WnrfDriver *driver, uint16_t channels, uint8_t streams);
+
+    /* A payload for offset onwards, offset may be negative (E1.31 channel_start) */
+    void feed(IngestSrc src, uint8_t stream, int32_t offset,
+              const uint8_t *data, uint16_t len, uint8_t seq, uint8_t flags);
+
+    /* End of frame without data (DDP push only, ZCPP sync) */
+    void commit(IngestSrc src);
+
+    void resetStats(void);
+    inline const ingest_stats_t * getStats(IngestSrc src) {
+        return &_stats[static_cast<uint8_t>(src)];
+    }
+
+ private:
+    WnrfDriver *_driver;
+    uint16_t    _channels;
+    uint8_t     _streams;
+    uint8_t    *_seq;        // Next E1.31 sequence number, per universe
+    uint8_t     _ddp_seq;    // Last DDP sequence (1..15), 0 = none yet
+    uint8_t     _zcpp_seq;   // Expected ZCPP frame sequence
+
+    ingest_stats_t _stats[static_cast<uint8_t>(IngestSrc::COUNT)];
+
+    void checkSeq(IngestSrc src, uint8_t stream, uint8_t seq, uint8_t flags);
+};
+
+#endif /* DMXINGEST_H_ */
@@ -22,11 +22,9 @@
 // Constructor
 ESPAsyncDDP::ESPAsyncDDP(uint8_t buffers) {
   pbuff = RingBuf_new(sizeof(DDP_packet_t), buffers);  
-  lastSequenceSeen = 0;
 
   stats.packetsReceived = 0;
   stats.bytesReceived = 0;
-  stats.errors = 0;
   stats.ddpMinChannel = 9999999;
   stats.ddpMaxChannel = 0;
 }
@@ -74,23 +72,6 @@ void ESPAsyncDDP::parsePacket(AsyncUDPPacket _packet) {
   stats.packetsReceived++;
   stats.bytesReceived += _packet.length();
 
-  int sn = sbuff->header.sequenceNum & 0xF;
-  if (sn) {
-    bool isErr = false;
-    if (lastSequenceSeen) {
-      if (sn == 1) {
-        if (lastSequenceSeen != 15) {
-          isErr = true;
-        }
-      } else if ((sn - 1) != lastSequenceSeen) {
-        isErr = true;
-      }
-    }
-    if (isErr) {
-      stats.errors++;
-    }
-    lastSequenceSeen = sn;
-  }
   if (stats.ddpMinChannel > htonl(sbuff->header.channelOffset)) {
     stats.ddpMinChannel = htonl(sbuff->header.channelOffset);
   }
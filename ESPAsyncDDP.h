@@ -74,7 +74,6 @@ typedef union __attribute__((packed)) {
 typedef struct __attribute__((packed)) {
   uint32_t packetsReceived;
   uint32_t bytesReceived;
-  uint32_t errors;
   uint32_t ddpMinChannel;
   uint32_t ddpMaxChannel;
 } DDP_stats_t;
@@ -85,7 +84,6 @@ class ESPAsyncDDP {
     DDP_packet_t   *sbuff;       // Pointer to scratch packet buffer
     AsyncUDP        udp;         // UDP
     RingBuf         *pbuff;      // Ring Buffer of universe packet buffers
-    uint8_t         lastSequenceSeen;
   
     // Internal Initializers
     bool initUDP(IPAddress ourIP);
@@ -83,15 +83,18 @@ void EffectEngine::begin(DRIVER* ledDriver, uint16_t ledCount) {
     _initialized = true;
 }
 
-void EffectEngine::run() {
+// True when an effect step ran, i.e. a new frame was written
+bool EffectEngine::run() {
     if (_initialized && _activeEffect && _activeEffect->func) {
         if (millis() - _effectLastRun >= _effectWait) {
             _effectLastRun = millis();
             uint16_t wait = (this->*_activeEffect->func)();
             _effectWait = max((int)wait, MIN_EFFECT_DELAY);
             _effectCounter++;
+            return true;
         }
     }
+    return false;
 }
 
 void EffectEngine::setEffect(const String effectName) {
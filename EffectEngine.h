@@ -74,7 +74,7 @@ public:
     EffectEngine();
 
     void begin(DRIVER* ledDriver, uint16_t ledCount);
-    void run();
+    bool run();
 
     String getEffect()                      { return _activeEffect ? _activeEffect->name : ""; }
     bool getReverse()                       { return _effectReverse; }
@@ -1,162 +1,285 @@
-#include <FS.h>
+#include "HexParser.h"
 
-int lhe_getc(File *file, char *input) {
-      if (file->readBytes(input,1)!=1) return -1;
-      return 1;
-}
-
-unsigned char x2i(char input) {
+static inline int x2i(int input) {
     if (input >= '0' && input <= '9') {
-        return input- '0';
+        return input - '0';
     } else if (input >= 'A' && input <= 'F') {
-        return input -('A' - 10);
+        return input - ('A' - 10);
     } else if (input >= 'a' && input <= 'f') {
-        return input- ('a' - 10);
+        return input - ('a' - 10);
     }
     return -1;
 }
 
-int lhe_getb(File *file,char *input) {
-   char temp[2];
+LheParser::LheParser(LheSource *src) {
+   _src   = src;
+   _pos   = 0;
+   _fill  = 0;
+   _base  = 0;
+   _lines = 0;
+   _done  = false;
+   _used  = 0;
+   _have  = false;
+   _line.len = 0;
+}
+
+// Two hex digits, <0 on a bad digit or the end of the source
+int LheParser::getb(void) {
+   int hi = getc();
+   int lo = getc();
 
-      if (file->readBytes(&temp[0],2)!=2) return -1;
-      *input = x2i(temp[1]) | (x2i(temp[0])<<4);
-      return 1;
+   if ((lo < 0) || (hi < 0)) return LHE_ERR_READ;
+   hi = x2i(hi);
+   lo = x2i(lo);
+   if ((lo < 0) || (hi < 0)) return LHE_ERR_FORMAT;
+   return (hi << 4) | lo;
 }
 
-int lhe_getw(File *file, uint16_t *input) {
-   char bytes[2];
+/*
+ * :<Count><AddrH><AddrL><Type><Data x Count><Csum>
+ * All the bytes, checksum included, add up to 0x00.
+ */
+int LheParser::nextLine(tLheLine *line) {
+   uint8_t hdr[4];
+   uint8_t sum = 0;
+   int c;
+
+   // Skip the line ending (and any blank lines) up to the next ':'
+   do {
+      c = getc();
+      if (c < 0) return LHE_EOF;
+   } while ((c == '\r') || (c == '\n') || (c == ' ') || (c == '\t'));
+   if (c != ':') return LHE_ERR_FORMAT;
+   _lines++;
+
+   for (int i=0;i<4;i++) {
+      if ((c = getb()) < 0) return c;
+      hdr[i] = c;
+      sum += c;
+   }
+   line->len  = hdr[0];
+   line->addr = (hdr[1] << 8) | hdr[2];
+   line->type = hdr[3];
+
+   for (int i=0;i<line->len;i++) {
+      if ((c = getb()) < 0) return c;
+      line->data[i] = c;
+      sum += c;
+   }
 
-   if (lhe_getb(file,&(bytes[0]))<0) return -1;
-   if (lhe_getb(file,&(bytes[1]))<0) return -1;
-   *input = bytes[0] << 8 | bytes[1];
+   if ((c = getb()) < 0) return c;
+   sum += c;
+   if (sum) return LHE_ERR_CSUM;
 
    return 1;
 }
 
-int lhe_scan_eol(File *file, int max) {
-int count = 0;
-   while (max--) {
-      char temp;
-      if (file->readBytes(&temp,1)!=1) return -1;
-      if (temp == 0x0A) break;
-      count++;
+int LheParser::nextData(void) {
+   while (!_done) {
+      int rc = nextLine(&_line);
+      if (rc <= 0) return rc;
+
+      switch (_line.type) {
+         case 0x00: // Data
+            _line.addr += _base;
+            return 1;
+         case 0x01: // End of File
+            _done = true;
+            break;
+         case 0x02: // Extended Segment Address
+            if (_line.len != 2) return LHE_ERR_FORMAT;
+            _base = ((_line.data[0] << 8) | _line.data[1]) << 4;
+            break;
+         case 0x04: // Extended Linear Address
+            if (_line.len != 2) return LHE_ERR_FORMAT;
+            _base = (uint32_t) ((_line.data[0] << 8) | _line.data[1]) << 16;
+            break;
+         case 0x03: // Start Segment Address
+         case 0x05: // Start Linear Address
+            break;   // Nothing to execute from on a PIC
+         default:
+            return LHE_ERR_FORMAT;
+      }
    }
-   return count;
+   return LHE_EOF;
 }
 
+/*
+ * Merge data lines into a span of up to 'max' bytes. A span ends where
+ * the next byte is not at the following address, or where it would cross
+ * a multiple of 'max' - a line can be split over two spans.
+ */
+int LheParser::nextSpan(uint32_t *addr, uint8_t *data, uint16_t max) {
+   uint32_t start = 0;
+   uint16_t len = 0;
+   uint16_t room = 0;
 
-int lhe_read_header(File *file, uint16_t *addr, uint8_t *csum) {
-   char marker= 0x00;
-   char count = 0x00;
-   char rtype = 0x00;
-
-      if (lhe_getc(file,&marker) != 1) {
-         if (!file->available()) return -1;
-         return  -2; // File Read Error
+   while (true) {
+      if (!_have) {
+         int rc = nextData();
+         if (rc < 0) return rc;
+         if (rc == LHE_EOF) break;
+         _have = true;
+         _used = 0;
       }
-      if (marker != ':') return -1;// Invalid file format
 
-      if (lhe_getb(file,&count)  != 1) return  -1;
-      if (lhe_getw(file,addr)   != 1) return  -1;
-      if (lhe_getb(file,&rtype)  != 1) return  -1;
+      uint32_t at = _line.addr + _used;
+      if (!len) {
+         start = at;
+         room  = max - (start % max);
+      } else if (at != start + len) {
+         break;   // Gap - leave this line for the next span
+      }
+      if (len >= room) break;
 
-      if (rtype==0) {
-         if (count>32) { // range error
-            return -3;
-         }
+      uint16_t take = _line.len - _used;
+      if (take > room - len) take = room - len;
+      memcpy(&data[len], &_line.data[_used], take);
+      len   += take;
+      _used += take;
+      if (_used >= _line.len) _have = false;
+   }
 
-         return count;
-      }
-      return 0;
+   *addr = start;
+   return len;
 }
 
-int lhe_read_payload(File *file,int count, char *data, uint8_t *csum) {
-  // Copy COUNT bytes into data array
-  while (count--) { // Populate the data array
-     if (lhe_getb(file,data++) !=1) return -1;
-  }
-  if (lhe_getb(file,(char *)csum)  != 1) return  -1;
-  return 0;
-}
+/*
+ * Convert an Intel HEX file into the binary OTA image. The HEX is parsed
+ * once: the records go into 'tmp' in file order while an index is built,
+ * then they are copied into 'img' in address order behind the header.
+ * Returns the number of records, <0 (LHE_ERR_xxx) on error.
+ */
+typedef struct {
+   uint16_t addr;
+   uint16_t ord;   // Record number in 'tmp'
+} tImageIndex;
 
-void lhe_dumpRec(uint16_t addr, uint8_t size, char * data) {
-   int csum = 0x00;
-   char tempstr[80];
+int lhe_build_image(File *hex, File *tmp, File *img) {
+   tImageIndex *index;
+   tImageHeader hdr;
+   tImageRecord rec;
+   uint16_t count = 0;
+   int rc = 0;
 
-   for (int i=0;i<size;i++) {
-      csum -= data[i];
-   }
-   csum &= 0xFF;
+   index = static_cast<tImageIndex *>(malloc(LHE_IMAGE_MAX_RECORDS * sizeof(tImageIndex)));
+   if (!index) return LHE_ERR_SIZE;
 
-   // Invoke the nRF Send function to send the 3 messages to the client
-   sprintf(tempstr,"Size: %2d Addr: %2.2x csum:%2.2x\n", size, addr,csum);
-   Serial.print(tempstr);
-}
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = LHE_IMAGE_MAGIC;
+
+   hex->seek(0, SeekSet);
+   LheFileSource src(hex);
+   LheParser parser(&src);
+
+   while (true) {
+      uint32_t addr;
+      uint8_t csum = 0;
 
+      memset(rec.data, 0xff, sizeof(rec.data));
+      rc = parser.nextSpan(&addr, rec.data, sizeof(rec.data));
+      if (rc <= 0) break;
 
-uint8_t lhe_read_record(File *file , uint16_t * addr, char * data ) {
-   uint8_t  csum_pending=0x00;
-   uint16_t count_pending = 0;
-   uint8_t  done = 0;
-
-   while (!done) {
-      uint8_t  csum=0x00;
-      uint16_t r_addr;
-      int count = lhe_read_header(file, &r_addr, &csum);
-
-      if (count>0) {
-         if (count_pending) {
-            // Trye and read second line of HEX
-            lhe_read_payload(file,count,&(data[count_pending]),&csum);
-            count_pending+=count;
-            done = 1;
-         } else {
-            // First Read
-            lhe_read_payload(file,count,data,&csum);
-            count_pending= count;
-            csum_pending = csum;
-            *addr = r_addr>>1;
-         }
-      }  else {
-         if (count_pending>0) {
-            done = 1;
-          }
+      if (count >= LHE_IMAGE_MAX_RECORDS) {
+         rc = LHE_ERR_SIZE;
+         break;
+      }
+      rec.addr = addr >> 1;
+      rec.size = rc;
+      for (size_t j=0;j<sizeof(rec.data);j++) {
+         csum -= rec.data[j];
+      }
+      rec.csum = csum;
+      if (tmp->write((uint8_t *) &rec, sizeof(rec)) != sizeof(rec)) {
+         rc = LHE_ERR_WRITE;
+         break;
+      }
 
+      index[count].addr = rec.addr;
+      index[count].ord  = count;
+      count++;
+
+      hdr.size += rec.size;
+      for (int i=0;i<rec.size;i+=2) {
+         hdr.csum -= (rec.data[i+1]<<8|rec.data[i]);
       }
-      // END of Line scan
-      if (lhe_scan_eol(file,80)< 0){
-         done = 0x01;
+   }
+
+   if (rc < 0) {
+      Serial.print(F("HEX error "));
+      Serial.print(rc);
+      Serial.print(F(" at line "));
+      Serial.println(parser.lines());
+      free(index);
+      return rc;
+   }
+
+   // Insertion sort - HEX files are normally in order already
+   for (int i=1;i<count;i++) {
+      tImageIndex temp = index[i];
+      int j = i;
+      while ((j>0) && (index[j-1].addr > temp.addr)) {
+         index[j] = index[j-1];
+         j--;
       }
+      index[j] = temp;
    }
 
-   return count_pending;
-}
+   hdr.records = count;
+   hdr.start   = count ? index[0].addr : 0;
+   if (img->write((uint8_t *) &hdr, sizeof(hdr)) != sizeof(hdr)) {
+      free(index);
+      return LHE_ERR_WRITE;
+   }
 
-uint8_t lhe_read_record_at(File *file, uint32_t offset, uint16_t *addr,  char * data ){
-   file->seek(offset,SeekSet);
-   return lhe_read_record(file, addr, data);
-}
+   for (int i=0;i<count;i++) {
+      if (!tmp->seek(index[i].ord * sizeof(rec), SeekSet) ||
+          (tmp->read((uint8_t *) &rec, sizeof(rec)) != sizeof(rec)) ||
+          (img->write((uint8_t *) &rec, sizeof(rec)) != sizeof(rec))) {
+         free(index);
+         return LHE_ERR_WRITE;
+      }
+   }
 
-void lhe_test(File *file) { // Pass in Open File Handle
+   free(index);
+   return count;
+}
 
-   uint8_t done = 0x00;
-   uint8_t lcount =0; // line Count
+bool lhe_read_image_header(File *img, tImageHeader *hdr) {
+   if (!img->seek(0, SeekSet)) return false;
+   if (img->read((uint8_t *) hdr, sizeof(*hdr)) != sizeof(*hdr)) return false;
+   return (hdr->magic == LHE_IMAGE_MAGIC);
+}
 
-   char  data[32];
-   uint8_t size;
-   uint16_t addr;
-   uint32_t last;
+bool lhe_read_image_record(File *img, uint16_t index, tImageRecord *rec) {
+   if (!img->seek(sizeof(tImageHeader) + index*sizeof(tImageRecord), SeekSet)) return false;
+   return (img->read((uint8_t *) rec, sizeof(*rec)) == sizeof(*rec));
+}
 
+void lhe_test(File *file) { // Pass in Open File Handle
+   LheFileSource src(file);
+   LheParser parser(&src);
+   uint8_t data[32];
+   uint32_t addr;
+   uint16_t spans = 0;
+   char tempstr[80];
+   int size;
 
-   while (file->available()) {
-     last = file->position();
-     size = lhe_read_record(file, &addr, data );
-     if (size) {
-        lcount++;
-        lhe_dumpRec(addr, size, data) ;
-     }
+   while ((size = parser.nextSpan(&addr, data, sizeof(data))) > 0) {
+      uint8_t csum = 0;
+      for (int i=0;i<size;i++) {
+         csum -= data[i];
+      }
+      sprintf(tempstr, "Size: %2d Addr: %4.4x csum:%2.2x\n", size, addr >> 1, csum);
+      Serial.print(tempstr);
+      spans++;
+   }
+   if (size < 0) {
+      Serial.print(F("HEX error "));
+      Serial.println(size);
    }
-   Serial.print(lcount);
-   Serial.println(" lines of rtype=0");
+   Serial.print(spans);
+   Serial.print(F(" spans from "));
+   Serial.print(parser.lines());
+   Serial.println(F(" lines"));
 }
@@ -1,10 +1,132 @@
 #ifndef HEXPARSER_H_
 #define HEXPARSER_H_
 
+#ifdef WNRF_HOST_SIM
+#include "host/FS.h"  // File over stdio, for the host harness
+#else
 #include "FS.h"  // Defn of 'File'
+#endif
 
-int lhe_test(File *file);
-uint8_t lhe_read_record(File *file, uint16_t *addr,  char * data );
-uint8_t lhe_read_record_at(File *file, uint32_t offset, uint16_t *addr,  char * data );
+/*
+ * Intel HEX parser. Reads the source a block at a time, checks every
+ * line's checksum, applies extended segment (02) and linear (04) address
+ * records and stops at the EOF (01) record. nextSpan() walks the data as
+ * runs of contiguous bytes, merged across lines.
+ */
+
+// Parser results
+#define LHE_EOF         (0)
+#define LHE_ERR_READ    (-1)   // Source ended mid line
+#define LHE_ERR_FORMAT  (-2)   // Missing ':', bad hex digit or record type
+#define LHE_ERR_CSUM    (-3)   // Line checksum mismatch
+#define LHE_ERR_SIZE    (-4)   // Too many records for the OTA image
+#define LHE_ERR_WRITE   (-5)   // OTA image write failed
+
+#define LHE_BUF_SIZE    (128)
+
+// Where the HEX text comes from
+class LheSource {
+ public:
+    virtual ~LheSource() {}
+    virtual int read(uint8_t *buf, int len) = 0;  // Bytes read, 0 at the end
+};
+
+class LheFileSource : public LheSource {
+ public:
+    LheFileSource(File *file) : _file(file) {}
+    int read(uint8_t *buf, int len) { return _file->read(buf, len); }
+ private:
+    File *_file;
+};
+
+#ifdef WNRF_HOST_SIM
+// Off-target: parse straight from a stdio stream
+class LheStdioSource : public LheSource {
+ public:
+    LheStdioSource(FILE *fp) : _fp(fp) {}
+    int read(uint8_t *buf, int len) { return fread(buf, 1, len, _fp); }
+ private:
+    FILE *_fp;
+};
+#endif
+
+typedef struct {
+    uint32_t addr;       // Byte address, extended address applied
+    uint8_t  type;
+    uint8_t  len;
+    uint8_t  data[255];
+} tLheLine;
+
+class LheParser {
+ public:
+    LheParser(LheSource *src);
+
+    /* Next line of any type: 1, LHE_EOF at the end of the source, <0 error */
+    int nextLine(tLheLine *line);
+
+    /* Next data line into line(): 1, LHE_EOF at the EOF record, <0 error */
+    int nextData(void);
+
+    /* Contiguous data, never crossing a 'max' byte boundary: bytes, 0 at the end, <0 error */
+    int nextSpan(uint32_t *addr, uint8_t *data, uint16_t max);
+
+    inline const tLheLine * line(void) { return &_line; }
+    inline uint32_t lines(void) { return _lines; }
+
+ private:
+    LheSource *_src;
+    uint8_t    _buf[LHE_BUF_SIZE];
+    uint16_t   _pos;
+    uint16_t   _fill;
+    uint32_t   _base;    // From the last extended address record
+    uint32_t   _lines;
+    bool       _done;    // EOF record seen
+    tLheLine   _line;    // Current data line
+    uint8_t    _used;    // Bytes of _line handed out by nextSpan()
+    bool       _have;    // _line still holds data for nextSpan()
+
+    inline int getc(void) {
+        if (_pos >= _fill) {
+            int n = _src->read(_buf, sizeof(_buf));
+            if (n <= 0) return -1;
+            _fill = n;
+            _pos = 0;
+        }
+        return _buf[_pos++];
+    }
+    int getb(void);
+};
+
+void lhe_test(File *file);
+
+/*
+ * Binary OTA image - the uploaded HEX parsed once into fixed size records,
+ * sorted by address, with the checksums the OTA engine needs worked out:
+ *    <tImageHeader><tImageRecord 0>..<tImageRecord n-1>
+ */
+#define LHE_IMAGE_FILE        "/16i/image.bin"
+#define LHE_IMAGE_TEMP        "/16i/image.tmp"
+#define LHE_IMAGE_MAGIC       (0x31524E57)   // "WNR1"
+#define LHE_IMAGE_MAX_RECORDS (512)          // 16K of PIC flash
+
+typedef struct __attribute__((packed)) {
+   uint32_t magic;
+   uint16_t records;   // Number of records that follow
+   uint16_t start;     // Lowest word address
+   uint32_t size;      // Data bytes (not counting 0xFF padding)
+   uint16_t csum;      // Word checksum over the image, for the AUDIT
+   uint16_t reserved;
+} tImageHeader;
+
+typedef struct __attribute__((packed)) {
+   uint16_t addr;      // Word address
+   uint8_t  size;      // Data bytes, the rest of data[] is 0xFF
+   uint8_t  csum;      // Byte checksum over data[], for the COMMIT
+   uint8_t  data[32];
+} tImageRecord;
+
+int  lhe_build_image(File *hex, File *tmp, File *img);
+bool lhe_read_image_header(File *img, tImageHeader *hdr);
+bool lhe_read_image_record(File *img, uint16_t index, tImageRecord *rec);
 
 #endif /* HEXPARSER_H_ */
@@ -0,0 +1,739 @@
+/*
+* RF24Sim.h - Host side stand-in for the RF24 radio used by WnrfDriver
+*
+* author: Andrew Williams (LabRat)
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*
+* Only compiled when WNRF_HOST_SIM is defined.  Replaces the RF24 class with
+* a model of the NRF24L01 that talks to a simulated "air" instead of SPI:
+*
+*     - Every radio call is charged an approximate SPI cost, and every packet
+*       an air time based on the configured data rate, against a virtual
+*       microsecond clock (SimAir::now_us).  millis()/micros() in the host
+*       shims (host/Arduino.h) read that clock.
+*     - Virtual client nodes listen on the broadcast, beacon and P2P addresses
+*       and answer the bootloader/application commands (0x85 beacon, 0x87
+*       bind, 0x80-0x83 OTA, 0x01/0x02 config) after a processing delay.
+*       Nodes with a bootloader version of 2 or more also take the windowed
+*       OTA packets (0x89), 3 or more the broadcast OTA (0x8A).
+*     - SimAir::report() prints packets/sec, universe refresh rate and the
+*       average command->ACK time for each OTA state.
+*
+* host/wnrf_sim.cpp runs the driver against it, "make -C host bench" runs
+* the standard scenarios.
+*/
+
+#ifndef RF24SIM_H_
+#define RF24SIM_H_
+
+#ifdef WNRF_HOST_SIM
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef enum { RF24_PA_MIN = 0, RF24_PA_LOW, RF24_PA_HIGH, RF24_PA_MAX, RF24_PA_ERROR } rf24_pa_dbm_e;
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+typedef enum { RF24_CRC_DISABLED = 0, RF24_CRC_8, RF24_CRC_16 } rf24_crclength_e;
+
+#define SIM_MAX_NODES    (64)
+#define SIM_SPI_US       (6)     // Approx cost of one SPI transaction at 8MHz
+#define SIM_SETTLE_US    (130)   // PLL settle time, Standby-I -> TX/RX
+#define SIM_NODE_US      (400)   // Client processing time before a reply
+#define SIM_FLASH_US     (2500)  // Client row erase/write time
+
+// Virtual client device (the PIC based dimmer packs)
+typedef struct sSimNode {
+    uint32_t dev_id;
+    uint8_t  type;
+    uint8_t  blv;
+    uint8_t  apm;
+    uint8_t  apv;
+    uint16_t start;
+    uint8_t  rf_chan;
+    uint8_t  loss;       // Percentage of packets this node fails to receive
+    uint32_t ctrl_addr;  // P2P return address handed out by the BIND
+    bool     bound;
+    uint32_t rx_blocks;  // Broadcast packets of its universe received
+    uint32_t rx_zip;     // ... of which compressed (0x1E) packets
+    uint8_t  dmx[4*17*31]; // Decoded channels, 17 blocks of 31 per universe
+    // Frame latch (0x1D): blocks are held until the latch applies them
+    uint8_t  held[4*17*31];
+    uint32_t held_mask[4];
+    uint32_t latches;
+    uint32_t latch_short;  // Latches naming a block that never arrived
+    uint32_t latch_gaps;   // Frame numbers skipped
+    int16_t  frame[4];     // Last frame latched per universe, -1 none
+    bool     latch;        // Client holds blocks for the latch
+    bool     telemetry;    // Beacon reply carries the link counters
+    uint8_t  parity[8][31]; // Parity blocks (17+n) held for the latch
+    uint8_t  parity_mask;
+    uint32_t fec_fixed;    // Blocks rebuilt from parity
+    uint32_t rx_p2p;     // P2P commands received
+    // Windowed OTA (blv 2+)
+    uint8_t  ota_next;   // Next sequence expected
+    uint32_t ota_map;    // Held packets, bit n = ota_next+1+n
+    uint32_t ota_prog;   // Held packets that complete a row
+    int16_t  ota_gap;    // ota_next when a gap was last reported, -1 none
+    uint32_t rows;       // Rows written
+    // Broadcast OTA (blv 3+)
+    bool     fleet;      // JOINed, listening on the fleet address
+    uint16_t fleet_records;
+    int16_t  fleet_half; // Record whose first half is held, -1 none
+    uint8_t  fleet_map[64]; // Records written, bit per record
+} tSimNode;
+
+// Packet waiting to be clocked into the controller RX FIFO
+typedef struct sSimReply {
+    uint64_t ready_us;
+    uint32_t addr;
+    uint8_t  cmd;
+    uint8_t  data[32];
+} tSimReply;
+
+class RF24Sim;
+
+class SimAir {
+ public:
+    uint64_t now_us;
+
+    tSimNode nodes[SIM_MAX_NODES];
+    uint8_t  node_count;
+
+    // Interference: percentage chance testCarrier() sees energy per channel
+    uint8_t  noise[126];
+
+    // Handler for the IRQ line (attachInterrupt() on the host)
+    void (*irq)(void);
+    RF24Sim *radio;
+
+    // Statistics
+    uint64_t start_us;
+    uint32_t tx_bcast;
+    uint32_t tx_p2p;
+    uint32_t tx_fail;
+    uint32_t rx_packets;
+    uint32_t spi_ops;
+    uint32_t universes;
+    uint8_t  last_block;
+    uint64_t cmd_sent_us[256];
+    uint64_t cmd_ack_us[256];
+    uint32_t cmd_acks[256];
+
+    SimAir() : irq(NULL), radio(NULL) { reset(); }
+
+    void reset() {
+        void (*handler)(void) = irq;
+        RF24Sim *attached = radio;
+
+        memset(this, 0, sizeof(*this));
+        last_block = 0xFF;
+        seed = 0x2545F491;
+        irq = handler;
+        radio = attached;
+    }
+
+    tSimNode * addNode(uint32_t dev_id, uint8_t type, uint8_t blv, uint8_t apm, uint8_t apv) {
+        if (node_count >= SIM_MAX_NODES) return NULL;
+        tSimNode *node = &nodes[node_count++];
+        memset(node, 0, sizeof(*node));
+        node->dev_id = dev_id;
+        node->type = type;
+        node->blv = blv;
+        node->apm = apm;
+        node->apv = apv;
+        for (int u = 0; u < 4; u++) node->frame[u] = -1;
+        return node;
+    }
+
+    void advance(uint32_t us);
+
+    bool lost(uint8_t pct) {
+        seed = seed * 1103515245 + 12345;
+        return ((seed >> 16) % 100) < pct;
+    }
+
+    bool carrier(uint8_t chan) {
+        return (chan < sizeof(noise)) && lost(noise[chan]);
+    }
+
+    // Queue a reply from a node, delivered to the controller after 'delay'
+    void reply(uint32_t addr, const uint8_t *data, uint32_t delay) {
+        if (pending >= SIM_MAX_NODES) return;
+        tSimReply *r = &replies[pending++];
+        r->ready_us = now_us + delay;
+        r->addr = addr;
+        r->cmd = data[0];
+        memcpy(r->data, data, 32);
+    }
+
+    // Oldest reply that has arrived by 'now' on one of the given addresses
+    int nextReply(const uint32_t *addrs, uint8_t count) {
+        int best = -1;
+        for (int i = 0; i < pending; i++) {
+            if (replies[i].ready_us > now_us) continue;
+            for (int p = 0; p < count; p++) {
+                if (addrs[p] && (replies[i].addr == addrs[p])) {
+                    if ((best < 0) || (replies[i].ready_us < replies[best].ready_us))
+                        best = i;
+                }
+            }
+        }
+        return best;
+    }
+
+    uint32_t replyAddr(int index) { return replies[index].addr; }
+    const uint8_t * replyData(int index) { return replies[index].data; }
+
+    void dropReply(int index) {
+        replies[index] = replies[--pending];
+    }
+
+    // Deliver a controller transmission to every node tuned to 'chan'
+    bool transmit(uint8_t chan, uint32_t addr, const uint8_t *data, bool ack);
+
+    // Windowed OTA bootloader, true when the node replies
+    bool windowed(tSimNode *node, const uint8_t *data, uint8_t *msg, uint32_t *delay);
+
+    // Full mode DMX block, plain or compressed, into node->dmx
+    void dmxData(tSimNode *node, const uint8_t *data);
+
+    // Broadcast OTA bootloader, DATA from the fleet address or P2P
+    void fleetData(tSimNode *node, const uint8_t *data);
+    void fleetRequest(tSimNode *node, const uint8_t *data, uint32_t delay);
+
+    void report(FILE *out) {
+        double secs = (now_us - start_us) / 1000000.0;
+        static const struct { uint8_t cmd; const char *name; } states[] = {
+            {0x87, "BIND"}, {0x80, "SETUP"}, {0x81, "WRITE"},
+            {0x82, "COMMIT"}, {0x83, "AUDIT"}, {0x89, "WINDOW"}, {0x01, "START"}
+        };
+
+        if (secs <= 0) secs = 1e-6;
+        fprintf(out, "Elapsed      : %.3f s\n", secs);
+        fprintf(out, "Broadcast    : %u pkts (%.1f pkts/s)\n", tx_bcast, tx_bcast / secs);
+        fprintf(out, "P2P          : %u pkts, %u failed\n", tx_p2p, tx_fail);
+        fprintf(out, "Universes    : %u (%.1f /s)\n", universes, universes / secs);
+        fprintf(out, "RX packets   : %u\n", rx_packets);
+        fprintf(out, "SPI ops      : %u\n", spi_ops);
+        for (unsigned i = 0; i < sizeof(states)/sizeof(states[0]); i++) {
+            uint8_t cmd = states[i].cmd;
+            if (cmd_acks[cmd]) {
+                fprintf(out, "OTA %-8s : %u acks, avg %.0f us\n", states[i].name,
+                        cmd_acks[cmd], (double) cmd_ack_us[cmd] / cmd_acks[cmd]);
+            }
+        }
+        for (int i = 0; i < node_count; i++) {
+            fprintf(out, "Node %6.6X  : %u blocks, %u cmds, %u rows\n", nodes[i].dev_id,
+                    nodes[i].rx_blocks, nodes[i].rx_p2p, nodes[i].rows);
+        }
+    }
+
+ private:
+    uint32_t  seed;
+    tSimReply replies[SIM_MAX_NODES];
+    uint8_t   pending;
+};
+
+extern SimAir sim_air;
+
+// Addresses used by WnrfDriver (see WnrfDriver.cpp)
+#define SIM_ADDR_BCAST (0xC0DE42)
+#define SIM_ADDR_CTRL  (0xC0DEC1)
+#define SIM_ADDR_FLEET (0xC0DEF1)
+
+inline bool SimAir::transmit(uint8_t chan, uint32_t addr, const uint8_t *data, bool ack) {
+    bool acked = false;
+    uint8_t msg[32];
+
+    for (int i = 0; i < node_count; i++) {
+        tSimNode *node = &nodes[i];
+        if (node->rf_chan != chan) continue;
+        if (lost(node->loss)) continue;
+
+        memset(msg, 0, sizeof(msg));
+        if (addr == SIM_ADDR_BCAST) {
+            // Only its own universe counts, as WnrfDriver::parseTelemetry() expects
+            if ((data[0] >> 5) == (node->start >> 9)) node->rx_blocks++;
+            dmxData(node, data);
+        } else if (addr == SIM_ADDR_FLEET) {
+            if (node->fleet) fleetData(node, data);
+        } else if (addr == SIM_ADDR_CTRL) {
+            if (data[0] == 0x85) { // Beacon - report identity
+                msg[0] = 0x88;
+                msg[1] = node->dev_id & 0xFF;
+                msg[2] = (node->dev_id >> 8) & 0xFF;
+                msg[3] = (node->dev_id >> 16) & 0xFF;
+                msg[4] = node->type;
+                msg[5] = node->blv;
+                msg[6] = node->apm;
+                msg[7] = node->apv;
+                msg[8] = node->start & 0xFF;
+                msg[9] = node->start >> 8;
+                if (node->telemetry) {
+                    msg[10] = 1; // NRF_TELEMETRY_V1
+                    memcpy(&msg[11], &node->rx_blocks, 4);
+                    msg[15] = node->latch_gaps & 0xFF;
+                    msg[16] = node->latch_gaps >> 8;
+                    msg[17] = node->latch_short & 0xFF;
+                    msg[18] = node->latch_short >> 8;
+                }
+                reply(SIM_ADDR_CTRL, msg, SIM_NODE_US * (i + 1));
+            }
+        } else if (addr == node->dev_id) {
+            uint32_t delay = SIM_NODE_US;
+            node->rx_p2p++;
+            acked = true;
+            msg[0] = data[0];
+            msg[1] = 0x01;
+            switch (data[0]) {
+                case 0x87: // BIND <id:3><ctrl:3>
+                    node->ctrl_addr = data[4] | data[5] << 8 | data[6] << 16;
+                    node->bound = true;
+                    node->ota_next = 0;
+                    node->ota_map = node->ota_prog = 0;
+                    node->ota_gap = -1;
+                    if (node->blv >= 2) msg[2] = node->blv; // Older bootloaders leave it 0
+                    break;
+                case 0x80: // SETUP (erase)
+                    delay = SIM_FLASH_US;
+                    break;
+                case 0x82: // COMMIT (write)
+                    delay = SIM_FLASH_US;
+                    node->rows++;
+                    break;
+                case 0x89: // Windowed OTA data
+                    if ((node->blv < 2) || !windowed(node, data, msg, &delay)) continue;
+                    break;
+                case 0x8A: // Broadcast OTA, replies go to the control address
+                    if (node->blv >= 3) fleetRequest(node, data, SIM_NODE_US * (i + 1));
+                    continue;
+                case 0x01: // E1.31 start address
+                    node->start = data[1] | data[2] << 8;
+                    break;
+                case 0x02: // RF channel
+                    node->rf_chan = data[1];
+                    break;
+                case 0x86: // Reset
+                    node->bound = false;
+                    continue;
+                default:
+                    break;
+            }
+            if (node->bound) {
+                reply(node->ctrl_addr, msg, delay);
+            }
+        }
+    }
+    return ack ? acked : true;
+}
+
+inline bool SimAir::windowed(tSimNode *node, const uint8_t *data, uint8_t *msg, uint32_t *delay) {
+    uint8_t n = data[1] - node->ota_next;
+    bool    program = data[4] & 0x02;
+    bool    send = false;
+
+    if (n == 0) {
+        // In order, then anything held behind it
+        node->ota_next++;
+        if (program) { node->rows++; send = true; }
+        while (node->ota_map & 1) {
+            if (node->ota_prog & 1) { node->rows++; send = true; }
+            node->ota_map >>= 1;
+            node->ota_prog >>= 1;
+            node->ota_next++;
+        }
+        node->ota_map >>= 1;
+        node->ota_prog >>= 1;
+        if (send) *delay = SIM_FLASH_US;
+    } else if (n < 128) {
+        // Ahead - hold it and report the gap once
+        if (n <= 32) {
+            node->ota_map |= 1UL << (n-1);
+            if (program) node->ota_prog |= 1UL << (n-1);
+        }
+        if (node->ota_gap != node->ota_next) {
+            node->ota_gap = node->ota_next;
+            send = true;
+        }
+    } else {
+        send = true; // Repeat of something already written
+    }
+
+    msg[2] = node->ota_next;
+    msg[3] = node->ota_map & 0xFF;
+    msg[4] = (node->ota_map >> 8) & 0xFF;
+    msg[5] = (node->ota_map >> 16) & 0xFF;
+    msg[6] = (node->ota_map >> 24) & 0xFF;
+    return send;
+}
+
+inline void SimAir::dmxData(tSimNode *node, const uint8_t *data) {
+    uint8_t  universe = data[0] >> 5;
+    uint8_t *dst = &node->held[universe*17*31];
+    uint32_t got = 0;
+
+    if ((data[0] & 0x1F) == 0x1D) {
+        uint32_t mask = data[2] | data[3] << 8 | (uint32_t) data[4] << 16;
+        node->latches++;
+        for (uint8_t g = 0; g < data[5] && g < 8; g++) {
+            if (!(node->parity_mask & (1 << g))) continue;
+            uint32_t group = 0;
+            for (uint8_t b = g; b < 17; b += data[5]) group |= 1UL << b;
+            uint32_t missing = mask & group & ~node->held_mask[universe];
+            if (__builtin_popcount(missing) != 1) continue;
+            uint8_t lost = __builtin_ctz(missing);
+            uint8_t *fix = &dst[lost*31];
+            memcpy(fix, node->parity[g], 31);
+            for (uint8_t b = 0; b < 17; b++) {
+                if ((mask & group & (1UL << b)) && (b != lost))
+                    for (int i = 0; i < 31; i++) fix[i] ^= dst[b*31 + i];
+            }
+            node->held_mask[universe] |= missing;
+            node->fec_fixed++;
+        }
+        node->parity_mask = 0;
+        if (mask & ~node->held_mask[universe]) node->latch_short++;
+        int16_t *frame = &node->frame[universe];
+        if ((*frame >= 0) && (uint8_t)(data[1] - *frame) > 1) node->latch_gaps++;
+        *frame = data[1];
+        for (uint8_t b = 0; b < 17; b++) {
+            if (node->held_mask[universe] & (1UL << b))
+                memcpy(&node->dmx[universe*17*31 + b*31], &dst[b*31], 31);
+        }
+        node->held_mask[universe] = 0;
+        return;
+    }
+    if (((data[0] & 0x1F) >= 17) && ((data[0] & 0x1F) < 25)) {
+        uint8_t g = (data[0] & 0x1F) - 17;
+        memcpy(node->parity[g], &data[1], 31);
+        node->parity_mask |= 1 << g;
+        return;
+    }
+    if ((data[0] & 0x1F) < 17) {
+        got = 1UL << (data[0] & 0x1F);
+        memcpy(&dst[(data[0] & 0x1F)*31], &data[1], 31);
+    } else if ((data[0] & 0x1F) == 0x1E) {
+        uint8_t block[31];
+        uint8_t in = 3;
+        node->rx_zip++;
+        for (uint8_t b = 0; b < data[2]; b++) {
+            uint8_t out = 0;
+            while (out < 31 && in < 32) {
+                uint8_t tok = data[in++];
+                if (tok < 0x80) {
+                    for (int i = 0; i <= tok && out < 31; i++) block[out++] = data[in++];
+                } else {
+                    for (int i = 0; i < tok - 0x80 + 2 && out < 31; i++) block[out++] = data[in];
+                    in++;
+                }
+            }
+            if (out == 31 && data[1] + b < 17) {
+                memcpy(&dst[(data[1] + b)*31], block, 31);
+                got |= 1UL << (data[1] + b);
+            }
+        }
+    }
+    if (node->latch) {
+        node->held_mask[universe] |= got;
+    } else { // Applied as they arrive
+        for (uint8_t b = 0; b < 17; b++) {
+            if (got & (1UL << b)) memcpy(&node->dmx[universe*17*31 + b*31], &dst[b*31], 31);
+        }
+    }
+}
+
+inline void SimAir::fleetData(tSimNode *node, const uint8_t *data) {
+    uint16_t rec = data[2] | data[3] << 8;
+
+    if (rec >= node->fleet_records) return;
+    if (!(data[6] & 0x02)) { // First half
+        node->fleet_half = rec;
+        return;
+    }
+    if (node->fleet_half != rec) return; // Missed the first half
+    node->fleet_half = -1;
+    if (!(node->fleet_map[rec >> 3] & (1 << (rec & 7)))) {
+        node->fleet_map[rec >> 3] |= 1 << (rec & 7);
+        node->rows++;
+    }
+}
+
+inline void SimAir::fleetRequest(tSimNode *node, const uint8_t *data, uint32_t delay) {
+    uint8_t msg[32];
+    uint16_t missing = 0;
+
+    memset(msg, 0, sizeof(msg));
+    memcpy(msg, data, 5);
+    for (int r = 0; r < node->fleet_records; r++) {
+        if (!(node->fleet_map[r >> 3] & (1 << (r & 7)))) missing++;
+    }
+    switch (data[1]) {
+        case 0x01: // JOIN
+            node->fleet = true;
+            node->fleet_records = data[5] | data[6] << 8;
+            node->fleet_half = -1;
+            memset(node->fleet_map, 0, sizeof(node->fleet_map));
+            return;
+        case 0x02: // DATA (repair)
+            if (node->fleet) fleetData(node, data);
+            return;
+        case 0x03: { // POLL
+            uint16_t from = data[5] | data[6] << 8;
+            msg[5] = data[5];
+            msg[6] = data[6];
+            msg[7] = missing & 0xFF;
+            msg[8] = missing >> 8;
+            for (int n = 0; n < 184 && from + n < node->fleet_records; n++) {
+                int r = from + n;
+                if (!(node->fleet_map[r >> 3] & (1 << (r & 7))))
+                    msg[9 + (n >> 3)] |= 1 << (n & 7);
+            }
+            break;
+        }
+        case 0x04: // AUDIT
+            msg[5] = node->fleet && !missing;
+            node->fleet = false;
+            break;
+        default:
+            return;
+    }
+    reply(SIM_ADDR_CTRL, msg, delay);
+}
+
+class RF24Sim {
+ public:
+    RF24Sim(uint16_t ce, uint16_t csn) : _ce(ce), _csn(csn) {}
+
+    bool begin(void) {
+        sim_air.radio = this;
+        memset(_rxaddr, 0, sizeof(_rxaddr));
+        _txaddr = 0;
+        _aa = 0x3F;
+        _chan = 76;
+        _rate = RF24_1MBPS;
+        _aw = 5;
+        _listening = false;
+        _txcount = 0;
+        _tx_ds = false;
+        spi(8);
+        return true;
+    }
+
+    void setChannel(uint8_t channel) { spi(1); _chan = channel; }
+    uint8_t getChannel(void) { spi(1); return _chan; }
+    void setPayloadSize(uint8_t) { spi(6); }
+    void enableDynamicPayloads(void) { spi(3); }
+    bool setDataRate(rf24_datarate_e speed) { spi(2); _rate = speed; return true; }
+    void setPALevel(uint8_t, bool = 1) { spi(2); }
+    void setCRCLength(rf24_crclength_e length) { spi(2); _crc = length; }
+    void setAddressWidth(uint8_t a_width) { spi(1); _aw = a_width; }
+    void printDetails(void) { sim_air.report(stdout); }
+
+    void setAutoAck(bool enable) { spi(1); _aa = enable ? 0x3F : 0; }
+    void setAutoAck(uint8_t pipe, bool enable) {
+        spi(2);
+        if (enable) _aa |= (1 << pipe); else _aa &= ~(1 << pipe);
+    }
+
+    void openWritingPipe(const uint8_t *address) { openWritingPipe(toAddr(address)); }
+    void openWritingPipe(uint64_t address) {
+        spi(3);
+        _txaddr = address & mask();
+    }
+    void openReadingPipe(uint8_t number, const uint8_t *address) { openReadingPipe(number, toAddr(address)); }
+    void openReadingPipe(uint8_t number, uint64_t address) {
+        spi(3);
+        if (number < 6) _rxaddr[number] = address & mask();
+    }
+
+    void startListening(void) {
+        spi(4);
+        txStandBy();
+        sim_air.advance(SIM_SETTLE_US);
+        _listening = true;
+    }
+    void stopListening(void) {
+        spi(3);
+        _listening = false;
+    }
+
+    bool write(const void *buf, uint8_t len) { return write(buf, len, false); }
+    bool write(const void *buf, uint8_t len, const bool multicast) {
+        bool ack = !multicast && (_aa & 0x01);
+        txStandBy();
+        spi(3);
+        sim_air.advance(SIM_SETTLE_US + airTime(len));
+        return send(static_cast<const uint8_t *>(buf), ack);
+    }
+
+    // TX FIFO - blocks queue behind each other and go out back to back
+    void startFastWrite(const void *buf, uint8_t len, const bool, bool = 1) {
+        spi(1);
+        txPump();
+        if (_txcount >= 3) return;  // Caller should have checked the FIFO
+        uint64_t begin = _txcount ? _txq[_txcount-1] : sim_air.now_us + SIM_SETTLE_US;
+        _txq[_txcount++] = begin + airTime(len);
+        send(static_cast<const uint8_t *>(buf), false);
+    }
+    bool writeFast(const void *buf, uint8_t len, const bool multicast) {
+        txPump();
+        if (_txcount >= 3) {
+            sim_air.advance(_txq[0] - sim_air.now_us);
+        }
+        startFastWrite(buf, len, multicast);
+        return true;
+    }
+    bool txStandBy(void) {
+        spi(1);
+        if (_txcount) {
+            sim_air.advance(_txq[_txcount-1] - sim_air.now_us);
+        }
+        return true;
+    }
+    bool isFifo(bool about_tx, bool check_empty) {
+        spi(1);
+        txPump();
+        if (about_tx) return check_empty ? (_txcount == 0) : (_txcount == 3);
+        return check_empty ? !available() : false;
+    }
+    void flush_tx(void) { spi(1); _txcount = 0; }
+    void maskIRQ(bool, bool, bool) { spi(2); }
+    void whatHappened(bool &tx_ok, bool &tx_fail, bool &rx_ready) {
+        spi(1);
+        txPump();
+        tx_ok = _tx_ds;
+        tx_fail = false;
+        rx_ready = false;
+        _tx_ds = false;
+    }
+
+    bool available(void) { return available(NULL); }
+    bool available(uint8_t *pipe_num) {
+        spi(1);
+        if (!_listening) return false;
+        uint32_t addrs[6];
+        for (int i = 0; i < 6; i++) addrs[i] = _rxaddr[i];
+        int r = sim_air.nextReply(addrs, 6);
+        if (r < 0) return false;
+        if (pipe_num) {
+            for (uint8_t p = 0; p < 6; p++) {
+                if (_rxaddr[p] == sim_air.replyAddr(r)) { *pipe_num = p; break; }
+            }
+        }
+        return true;
+    }
+
+    void read(void *buf, uint8_t len) {
+        uint32_t addrs[6];
+        spi(2);
+        for (int i = 0; i < 6; i++) addrs[i] = _rxaddr[i];
+        int r = sim_air.nextReply(addrs, 6);
+        if (r < 0) return;
+        const uint8_t *data = sim_air.replyData(r);
+        uint8_t cmd = data[0];
+        memcpy(buf, data, len > 32 ? 32 : len);
+        sim_air.rx_packets++;
+        if (sim_air.cmd_sent_us[cmd]) {
+            sim_air.cmd_ack_us[cmd] += sim_air.now_us - sim_air.cmd_sent_us[cmd];
+            sim_air.cmd_acks[cmd]++;
+            sim_air.cmd_sent_us[cmd] = 0;
+        }
+        sim_air.dropReply(r);
+    }
+
+    // Time has moved on - retire blocks that have finished on air
+    void poll(void) { txPump(); }
+
+    bool testCarrier(void) { spi(1); return sim_air.carrier(_chan); }
+    bool testRPD(void) { return testCarrier(); }
+
+ private:
+    uint16_t _ce, _csn;
+    uint64_t _txaddr;
+    uint64_t _rxaddr[6];
+    uint8_t  _aa;
+    uint8_t  _chan;
+    uint8_t  _aw;
+    rf24_datarate_e  _rate;
+    rf24_crclength_e _crc;
+    bool     _listening;
+    uint64_t _txq[3];     // Completion time of each block in the TX FIFO
+    uint8_t  _txcount;
+    bool     _tx_ds;
+
+    void txPump(void) {
+        while (_txcount && (_txq[0] <= sim_air.now_us)) {
+            _txq[0] = _txq[1];
+            _txq[1] = _txq[2];
+            _txcount--;
+            if (!_tx_ds && sim_air.irq) sim_air.irq(); // IRQ falling edge
+            _tx_ds = true;
+        }
+    }
+
+    void spi(uint8_t count) {
+        sim_air.spi_ops += count;
+        sim_air.advance(count * SIM_SPI_US);
+    }
+
+    uint64_t mask(void) { return (_aw >= 5) ? 0xFFFFFFFFFFULL : ((1ULL << (8 * _aw)) - 1); }
+
+    uint64_t toAddr(const uint8_t *address) {
+        uint64_t addr = 0;
+        for (int i = _aw - 1; i >= 0; i--) addr = (addr << 8) | address[i];
+        return addr;
+    }
+
+    // Preamble + address + payload + CRC + 9 bit packet control field
+    uint32_t airTime(uint8_t len) {
+        uint32_t bits = 8 * (1 + _aw + len + _crc) + 9;
+        switch (_rate) {
+            case RF24_2MBPS:   return bits / 2;
+            case RF24_250KBPS: return bits * 4;
+            default:           return bits;
+        }
+    }
+
+    bool send(const uint8_t *data, bool ack) {
+        bool retCode;
+        if (_txaddr == SIM_ADDR_BCAST) {
+            uint8_t block = data[0];
+            if (block <= sim_air.last_block && sim_air.last_block != 0xFF)
+                sim_air.universes++;
+            sim_air.last_block = block;
+            sim_air.tx_bcast++;
+        } else {
+            sim_air.tx_p2p++;
+            if (!sim_air.cmd_sent_us[data[0]])
+                sim_air.cmd_sent_us[data[0]] = sim_air.now_us;
+        }
+        retCode = sim_air.transmit(_chan, (uint32_t) _txaddr, data, ack);
+        if (ack) {
+            // Wait for (or time out on) the auto-ack
+            sim_air.advance(SIM_SETTLE_US + airTime(0));
+            if (!retCode) sim_air.tx_fail++;
+        }
+        return retCode;
+    }
+};
+
+inline void SimAir::advance(uint32_t us) {
+    now_us += us;
+    if (radio) radio->poll();
+}
+
+typedef RF24Sim RF24;
+
+#endif /* WNRF_HOST_SIM */
+#endif /* RF24SIM_H_ */
@@ -131,6 +131,14 @@ typedef struct {
     NrfChan     nrf_chan;       /* Radio Frequency       */
     NrfBaud     nrf_baud;       /* Baudrate 250k/1Mb/2Mb */
     bool        nrf_legacy;     /* Support Early NRF designs (32 byte payload) */
+    uint16_t    nrf_keepalive;  /* ms between resends of unchanged blocks */
+    uint8_t     nrf_universes;  /* Universes out, one per RF channel from nrf_chan */
+    bool        nrf_shared;     /* All universes on nrf_chan, universe id in the header */
+    uint8_t     nrf_dmx_share;  /* % of air time DMX keeps while in admin mode */
+    uint8_t     nrf_auto;       /* Auto channel, NRF_AUTOCHAN_xxx */
+    uint8_t     nrf_compress;   /* Compressed packets, NRF_ZIP_xxx */
+    bool        nrf_latch;      /* Clients apply a frame on its latch packet */
+    uint8_t     nrf_fec;        /* Parity blocks per cycle, 0 none */
 #endif
 } config_t;
 
@@ -140,6 +148,11 @@ void dsNetworkConfig(const JsonObject &json);
 void dsDeviceConfig(const JsonObject &json);
 void dsEffectConfig(const JsonObject &json);
 void saveConfig();
+void writeConfig();
+int buildFWImage();
+#if defined(ESPS_MODE_WNRF)
+void serializeRadioStats(String &jsonString);
+#endif
 
 void connectWifi();
 void onWifiConnect(const WiFiEventStationModeGotIP &event);
@@ -37,6 +37,8 @@ const char passphrase[] = "";
 #include <ESPAsyncE131.h>
 #include "ESPAsyncZCPP.h"
 #include "ESPAsyncDDP.h"
+#include "DmxIngest.h"
+#include "HexParser.h"
 #include <Hash.h>
 #include <SPI.h>
 #include "WNRF.h"
@@ -79,17 +81,14 @@ ESPAsyncE131        e131(10);       // ESPAsyncE131 with X buffers
 ESPAsyncZCPP        zcpp(5);        // ESPAsyncZCPP with X buffers
 ESPAsyncDDP         ddp(5);         // ESPAsyncDDP with X buffers
 FPPDiscovery        fppDiscovery(VERSION);   // FPP Discovery Listener
+DmxIngest           ingest;         // Common E1.31/DDP/ZCPP ingest and stats
 
 config_t            config;         // Current configuration
-uint32_t            *seqError;      // Sequence error tracking for each universe
-uint32_t            *seqZCPPError;  // Sequence error tracking for each universe
 uint16_t            lastZCPPConfig; // last config we saw
-uint8_t             seqZCPPTracker; // sequence number of zcpp frames
 uint16_t            uniLast = 1;    // Last Universe to listen for
 bool                reboot = false; // Reboot flag
 AsyncWebServer      web(HTTP_PORT); // Web Server
 AsyncWebSocket      ws("/ws");      // Web Socket Plugin
-uint8_t             *seqTracker;    // Current sequence numbers for each Universe */
 uint32_t            lastUpdate;     // Update timeout tracker
 WiFiEventHandler    wifiConnectHandler;     // WiFi connect handler
 WiFiEventHandler    wifiDisconnectHandler;  // WiFi disconnect handler
@@ -273,6 +272,9 @@ void setup() {
             WiFi.softAP(ssid.c_str());
             ourLocalIP = WiFi.softAPIP();
             ourSubnetMask = IPAddress(255,255,255,0);
+#if defined(ESPS_MODE_WNRF)
+            out_driver.setAutoChan(config.nrf_auto, WiFi.channel());
+#endif
 #if defined(LED_WIFI)
             led_state_wifi = BEAT;
 #endif
@@ -389,6 +391,11 @@ void onWifiConnect(const WiFiEventStationModeGotIP &event) {
   ourLocalIP = WiFi.localIP();
   ourSubnetMask = WiFi.subnetMask();
 
+#if defined(ESPS_MODE_WNRF)
+  // Auto channel keeps clear of the Wi-Fi channel we landed on
+  out_driver.setAutoChan(config.nrf_auto, WiFi.channel());
+#endif
+
 #ifdef MQTT
   // Setup MQTT connection if enabled
   if (config.mqtt)
@@ -668,6 +675,29 @@ int getFWName(void) {
     }
 }
 
+// Parse the uploaded HEX once, into the binary image the OTA engine sends
+int buildFWImage(void) {
+    int records = -1;
+
+    SPIFFS.remove(LHE_IMAGE_FILE);
+    if (getFWName()) {
+        File hex = SPIFFS.open(fw_name, "r");
+        File tmp = SPIFFS.open(LHE_IMAGE_TEMP, "w+");
+        File img = SPIFFS.open(LHE_IMAGE_FILE, "w");
+        if (hex && tmp && img)
+            records = lhe_build_image(&hex, &tmp, &img);
+        if (hex) hex.close();
+        if (tmp) tmp.close();
+        if (img) img.close();
+        SPIFFS.remove(LHE_IMAGE_TEMP);
+        if (records <= 0)
+            SPIFFS.remove(LHE_IMAGE_FILE);
+    }
+    LOG_PORT.print(F("OTA image records: "));
+    LOG_PORT.println(records);
+    return records;
+}
+
 void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final){
   if(!index){
     LOG_PORT.print(F("UploadStart: "));
@@ -682,6 +712,7 @@ void handleUpload(AsyncWebServerRequest *request, String filename, size_t index,
       File f = dir.openFile("r");
       LOG_PORT.println(")");
     }
+    SPIFFS.remove(LHE_IMAGE_FILE);
     file = SPIFFS.open("/16f/"+filename,"w");
   }
 
@@ -705,7 +736,11 @@ void handleUpload(AsyncWebServerRequest *request, String filename, size_t index,
     LOG_PORT.print(F("FILENAME:"));
     LOG_PORT.print(fw_name);
     LOG_PORT.print(".\n");
-    cb_upload_reply(200, fw_name);
+    if (buildFWImage() > 0) {
+        cb_upload_reply(200, fw_name);
+    } else {
+        cb_upload_reply(422, fw_name);
+    }
   }
 }
 
@@ -726,6 +761,17 @@ void initWeb() {
     request->send(200, "text/plain", String(ESP.getFreeHeap()));
   });
 
+#if defined(ESPS_MODE_WNRF)
+  // Radio statistics, /radio?reset to start counting afresh
+  web.on("/radio", HTTP_GET, [](AsyncWebServerRequest * request) {
+    String jsonString;
+    serializeRadioStats(jsonString);
+    if (request->hasParam("reset"))
+        out_driver.resetStats();
+    request->send(200, "text/json", jsonString);
+  });
+#endif
+
   // JSON Config Handler
   web.on("/conf", HTTP_GET, [](AsyncWebServerRequest * request) {
     String jsonString;
@@ -806,10 +852,38 @@ void validateConfig() {
 #if defined(ESPS_MODE_WNRF)
     // Set Mode
     config.devmode = MODE_NRF;
-    if (config.nrf_legacy)
+    if (config.nrf_legacy) {
+        config.nrf_universes = 1;
         config.channel_count = 32;
-    else
-        config.channel_count = 512;
+    } else {
+        // One universe per RF channel, counting up from nrf_chan, unless shared
+        uint8_t room = (uint8_t) NrfChan::NRFCHAN_G - (uint8_t) config.nrf_chan + 1;
+        if (config.nrf_shared)
+            room = NRF_MAX_UNIVERSES;
+        if (config.nrf_universes < 1)
+            config.nrf_universes = 1;
+        if (config.nrf_universes > NRF_MAX_UNIVERSES)
+            config.nrf_universes = NRF_MAX_UNIVERSES;
+        if (config.nrf_universes > room)
+            config.nrf_universes = room;
+
+        // Only the blocks holding these channels go on air. The universes
+        // set the limit, a count that leaves the last one empty (or the 32
+        // kept from Legacy mode, where it selects Legacy in the driver) is
+        // reset to whole universes
+        if (config.channel_count <= 512 * (config.nrf_universes - 1) ||
+            config.channel_count > 512 * config.nrf_universes ||
+            config.channel_count == 32)
+            config.channel_count = 512 * config.nrf_universes;
+    }
+    if (config.nrf_dmx_share < NRF_DMX_SHARE_MIN || config.nrf_dmx_share > 100)
+        config.nrf_dmx_share = NRF_DMX_SHARE;
+    if (config.nrf_legacy || config.nrf_auto > NRF_AUTOCHAN_MIGRATE)
+        config.nrf_auto = NRF_AUTOCHAN_OFF;
+    if (config.nrf_legacy || config.nrf_compress > NRF_ZIP_ON)
+        config.nrf_compress = NRF_ZIP_OFF;
+    if (config.nrf_legacy || config.nrf_fec > NRF_FEC_MAX)
+        config.nrf_fec = 0;
 #endif
 
     if (config.effect_speed < 1)
@@ -851,28 +925,23 @@ void updateConfig() {
     else
         uniLast = config.universe + span / config.universe_limit - 1;
 
-    // Setup the sequence error tracker
+    // Universes for the sequence trackers
     uint8_t uniTotal = (uniLast + 1) - config.universe;
 
-    if (seqTracker) free(seqTracker);
-    if ((seqTracker = static_cast<uint8_t *>(malloc(uniTotal))))
-        memset(seqTracker, 0x00, uniTotal);
-
-    seqZCPPTracker = 0;
-
-    if (seqError) free(seqError);
-    if ((seqError = static_cast<uint32_t *>(malloc(uniTotal * 4))))
-        memset(seqError, 0x00, uniTotal * 4);
-
-    seqZCPPError = 0;
-
     // Zero out packet stats
     e131.stats.num_packets = 0;
     zcpp.stats.num_packets = 0;
 
     // Initialize for our pixel type
 #if defined(ESPS_MODE_WNRF)
-    out_driver.begin(config.nrf_baud, config.nrf_chan, config.channel_count);
+    out_driver.begin(config.nrf_baud, config.nrf_chan, config.channel_count, config.nrf_universes, config.nrf_shared);
+    out_driver.setKeepAlive(config.nrf_keepalive);
+    out_driver.setDmxShare(config.nrf_dmx_share);
+    out_driver.setAutoChan(config.nrf_auto, WiFi.channel());
+    out_driver.setCompress(config.nrf_compress);
+    out_driver.setLatch(config.nrf_latch && !config.nrf_legacy);
+    out_driver.setFec(config.nrf_fec);
+    ingest.begin(&out_driver, config.channel_count, uniTotal);
     effects.begin(&out_driver, config.channel_count / 3 );
     register_nrf_callbacks(); // Allow NRF driver to send ASYNC responses to WEB client
 #endif
@@ -1019,8 +1088,15 @@ void dsDeviceConfig(const JsonObject &json) {
         } else {
             config.nrf_chan = NrfChan(static_cast<uint8_t>(json["wnrf"]["nrf_chan"]));
             config.nrf_baud = NrfBaud(static_cast<uint32_t>(json["wnrf"]["nrf_baud"]));
-            config.channel_count = 512;
+            config.nrf_universes = json["wnrf"]["universes"] | 1;
+            config.nrf_shared = json["wnrf"]["shared"] | false;
         }
+        config.nrf_keepalive = json["wnrf"]["keepalive"] | NRF_KEEPALIVE_MS;
+        config.nrf_dmx_share = json["wnrf"]["dmx_share"] | NRF_DMX_SHARE;
+        config.nrf_auto = json["wnrf"]["auto_chan"] | NRF_AUTOCHAN_OFF;
+        config.nrf_compress = json["wnrf"]["compress"] | NRF_ZIP_OFF;
+        config.nrf_latch = json["wnrf"]["latch"] | false;
+        config.nrf_fec = json["wnrf"]["fec"] | 0;
     }
     else
     {
@@ -1028,6 +1104,14 @@ void dsDeviceConfig(const JsonObject &json) {
 	config.nrf_chan = NrfChan::NRFCHAN_G;
 	config.nrf_baud = NrfBaud::BAUD_2Mbps;
 	config.channel_count = 512;
+	config.nrf_universes = 1;
+	config.nrf_shared = false;
+	config.nrf_keepalive = NRF_KEEPALIVE_MS;
+	config.nrf_dmx_share = NRF_DMX_SHARE;
+	config.nrf_auto = NRF_AUTOCHAN_OFF;
+	config.nrf_compress = NRF_ZIP_OFF;
+	config.nrf_latch = false;
+	config.nrf_fec = 0;
     }
 #endif
 }
@@ -1157,6 +1241,14 @@ void serializeConfig(String &jsonString, bool pretty, bool creds) {
     wnrf["enabled"]  = config.nrf_legacy;
     wnrf["nrf_chan"] = static_cast<uint8_t>(config.nrf_chan);
     wnrf["nrf_baud"] = static_cast<uint8_t>(config.nrf_baud);
+    wnrf["keepalive"] = config.nrf_keepalive;
+    wnrf["universes"] = config.nrf_universes;
+    wnrf["shared"] = config.nrf_shared;
+    wnrf["dmx_share"] = config.nrf_dmx_share;
+    wnrf["auto_chan"] = config.nrf_auto;
+    wnrf["compress"] = config.nrf_compress;
+    wnrf["latch"] = config.nrf_latch;
+    wnrf["fec"] = config.nrf_fec;
     getFWName();
     wnrf["nrf_fw"] =fw_name;
 #endif
@@ -1167,11 +1259,66 @@ void serializeConfig(String &jsonString, bool pretty, bool creds) {
         serializeJson(json, jsonString);
 }
 
+#if defined(ESPS_MODE_WNRF)
+static void serializeHist(JsonObject &parent, const char *name, const tNrfHist *hist) {
+    JsonObject h = parent.createNestedObject(name);
+    h["count"] = hist->count;
+    h["avg_us"] = hist->count ? (uint32_t) (hist->total_us / hist->count) : 0;
+    h["max_us"] = hist->max_us;
+    JsonArray buckets = h.createNestedArray("log2_us");
+    for (int i = 0; i < NRF_HIST_BUCKETS; i++)
+        buckets.add(hist->bucket[i]);
+}
+
+// Serialize the radio counters and histograms into a JSON string
+void serializeRadioStats(String &jsonString) {
+    const tNrfStats *stats = out_driver.getStats();
+    uint32_t elapsed = millis() - stats->since;
+    DynamicJsonDocument json(4096);
+
+    json["elapsed_ms"] = elapsed;
+
+    JsonObject tx = json.createNestedObject("tx");
+    tx["blocks"] = stats->tx_blocks;
+    tx["packets"] = stats->tx_packets;
+    tx["fail"] = stats->tx_fail;
+    tx["retries"] = stats->retries;
+    tx["timeouts"] = stats->timeouts;
+    JsonArray cycles = tx.createNestedArray("cycles");
+    JsonArray cps = tx.createNestedArray("cycles_per_sec");
+    for (int i = 0; i < config.nrf_universes; i++) {
+        cycles.add(stats->cycles[i]);
+        cps.add(elapsed ? (float) stats->cycles[i] * 1000 / elapsed : 0);
+    }
+    serializeHist(tx, "write", &stats->write_us);
+    serializeHist(tx, "load", &stats->load_us);
+    serializeHist(tx, "cycle", &stats->cycle_us);
+
+    JsonObject rx = json.createNestedObject("rx");
+    JsonArray pipes = rx.createNestedArray("pipes");
+    for (int i = 0; i < 6; i++)
+        pipes.add(stats->rx_packets[i]);
+
+    // Round trips only for the states that have seen an ACK
+    JsonObject ack = json.createNestedObject("ack");
+    for (int i = 0; i < NRF_ACK_STATES; i++) {
+        if (stats->ack_us[i].count)
+            serializeHist(ack, WnrfDriver::ackStateName(i), &stats->ack_us[i]);
+    }
+
+    serializeJson(json, jsonString);
+}
+#endif
+
 // Save configuration JSON file
 void saveConfig() {
     // Update Config
     updateConfig();
+    writeConfig();
+}
 
+// Save the configuration file only, nothing is restarted
+void writeConfig() {
     // Serialize Config
     String jsonString;
     serializeConfig(jsonString, true, true);
@@ -1245,8 +1392,6 @@ void loop() {
         ESP.restart();
     }
 
-    bool doShow = true;
-
 #if defined(LED_WIFI) || defined(LED_NRF)
     blink_led();
 #endif
@@ -1266,69 +1411,36 @@ void loop() {
                 //LOG_PORT.print(universe);
                 //LOG_PORT.println(packet.sequence_number);
                 if ((universe >= config.universe) && (universe <= uniLast)) {
-                    // Universe offset and sequence tracking
                     uint8_t uniOffset = (universe - config.universe);
-                    if (packet.sequence_number != seqTracker[uniOffset]++) {
-                        LOG_PORT.print(F("Sequence Error - expected: "));
-                        LOG_PORT.print(seqTracker[uniOffset] - 1);
-                        LOG_PORT.print(F(" actual: "));
-                        LOG_PORT.print(packet.sequence_number);
-                        LOG_PORT.print(F(" universe: "));
-                        LOG_PORT.println(universe);
-                        seqError[uniOffset]++;
-                        seqTracker[uniOffset] = packet.sequence_number + 1;
-                    }
-
-                    // Offset the channels if required
-                    uint16_t offset = 0;
-                    offset = config.channel_start - 1;
-
-                    // Find start of data based off the Universe
-                    int16_t dataStart = uniOffset * config.universe_limit - offset;
-
-                    // Calculate how much data we need for this buffer
-                    uint16_t dataStop = config.channel_count;
+
+                    // Find start of data based off the Universe, less the
+                    // channels skipped ahead of channel_start
+                    int32_t dataStart = uniOffset * config.universe_limit - (config.channel_start - 1);
                     uint16_t channels = htons(packet.property_value_count) - 1;
                     if (config.universe_limit < channels)
                         channels = config.universe_limit;
-                    if ((dataStart + channels) < dataStop)
-                        dataStop = dataStart + channels;
-
-                    // Set the data
-                    uint16_t buffloc = 0;
-
-                    // ignore data from start of first Universe before channel_start
-                    if (dataStart < 0) {
-                        dataStart = 0;
-                        buffloc = config.channel_start - 1;
-                    }
-
-                    for (int i = dataStart; i < dataStop; i++) {
-                        out_driver.setValue(i, data[buffloc]);
-                        buffloc++;
-                    }
+
+                    // Last universe completes the frame (ESPAsyncE131 does
+                    // not pass E1.31 sync packets through)
+                    ingest.feed(IngestSrc::E131, uniOffset, dataStart, data, channels,
+                                packet.sequence_number,
+                                INGEST_SEQ | ((universe == uniLast) ? INGEST_COMMIT : 0));
                 }
             }
             while (!ddp.isEmpty()) {
               DDP_packet_t ddpPacket;
               ddp.pull(&ddpPacket);
-              if (ddpPacket.header.flags & 0x01) {
-                doShow = true;
-              } else {
-                doShow = false;
-              }
               uint16_t len = htons(ddpPacket.header.dataLen);
               uint32_t offset = htonl(ddpPacket.header.channelOffset);
               bool tc = ddpPacket.header.flags & 0x10;
+              uint8_t seq = ddpPacket.header.sequenceNum & 0xF;
               uint8_t *data = ddpPacket.header.data;
               if (tc) {
                 data = ddpPacket.timeCodeHeader.data;
               }
-              for (int i = offset; i < offset + len; i++) {
-                if (i < config.channel_count) {
-                 out_driver.setValue(i, data[i - offset]);
-                }
-              }
+              ingest.feed(IngestSrc::DDP, 0, offset, data, len, seq,
+                          (seq ? INGEST_SEQ : 0) |
+                          ((ddpPacket.header.flags & DDP_PUSH_FLAG) ? INGEST_COMMIT : 0));
             }
 
             bool abortPacketRead = false;
@@ -1412,7 +1524,7 @@ void loop() {
                       sendZCPPConfig(zcppPacket);
                       break;
                   case ZCPP_TYPE_SYNC: // sync
-                    doShow = true;
+                    ingest.commit(IngestSrc::ZCPP);
                     // exit read and send data to the pixels
                     abortPacketRead = true;
                     break;
@@ -1423,48 +1535,38 @@ void loop() {
                       uint16_t len = htons(zcppPacket.Data.packetDataLength);
                       bool sync = (zcppPacket.Data.flags & ZCPP_DATA_FLAG_SYNC_WILL_BE_SENT) != 0;
 
-                      if (sync) {
-                        // suppress display until we see a sync
-                        doShow = false;
-                      }
-
-                      if (seq != seqZCPPTracker) {
-                        LOG_PORT.print(F("Sequence Error - expected: "));
-                        LOG_PORT.print(seqZCPPTracker);
-                        LOG_PORT.print(F(" actual: "));
-                        LOG_PORT.println(seq);
-                        seqZCPPError++;
-                      }
-
-                      if (frameLast)
-                        seqZCPPTracker = seq + 1;
-
-                      zcpp.stats.num_packets++;
-
-                      for (int i = offset; i < offset + len; i++) {
-                         out_driver.setValue(i, zcppPacket.Data.data[i - offset]);
-                      }
+                      // With a sync to follow, hold the frame until it arrives
+                      ingest.feed(IngestSrc::ZCPP, 0, offset, zcppPacket.Data.data, len, seq,
+                                  INGEST_SEQ | (frameLast ? INGEST_EOF : 0) |
+                                  ((frameLast && !sync) ? INGEST_COMMIT : 0));
 
                       break;
                 }
             }
     }
 
-    if (doShow) {
-        /* LabRat - replace with != DataSource::E131 ?? */
-        if ( (config.ds == DataSource::WEB)
-          || (config.ds == DataSource::IDLEWEB)
-          || (config.ds == DataSource::ZCPP)
-          || (config.ds == DataSource::DDP)
-          || (config.ds == DataSource::MQTT) ) {
-                effects.run();
-        }
+    /* LabRat - replace with != DataSource::E131 ?? */
+    bool stepped = false;
+    if ( (config.ds == DataSource::WEB)
+      || (config.ds == DataSource::IDLEWEB)
+      || (config.ds == DataSource::ZCPP)
+      || (config.ds == DataSource::DDP)
+      || (config.ds == DataSource::MQTT) ) {
+            stepped = effects.run();
+    }
 
-        /* Streaming refresh */
-        if (out_driver.canRefresh())
-            out_driver.show();
+    // Each effect step is a complete frame, commit it once
+    if ( stepped
+      && ((config.ds == DataSource::WEB)
+       || (config.ds == DataSource::IDLEWEB)
+       || (config.ds == DataSource::MQTT)) ) {
+            out_driver.commit();
     }
 
+    /* Streaming refresh - frames are committed by their source above */
+    if (out_driver.canRefresh())
+        out_driver.show();
+
 // workaround crash - consume incoming bytes on serial port
     if (LOG_PORT.available()) {
         int8_t inch = LOG_PORT.read();
@@ -39,15 +39,23 @@
 *
 */
 
+#ifdef WNRF_HOST_SIM
+#include "RF24Sim.h"   // Off-target: simulated radio and client nodes
+#include <Arduino.h>   // ... and the core stand-ins from host/
+#else
 #include <SPI.h>
 #include "RF24.h"
+#endif
 #include "WnrfDriver.h"
 #include <printf.h>
 #include <FS.h> // Defn of 'File'
 #include "HexParser.h"
 
 // Some common board pin assignments
-#ifdef WEMOS_D1
+#ifdef WNRF_HOST_SIM
+   SimAir sim_air;
+   RF24 radio(4,5);
+#elif defined(WEMOS_D1)
    // WeMos R1
    RF24 radio(D4,D8);
 #else
@@ -66,6 +74,35 @@
 #define NRF_CTL_W4_CHAN_ACK   (0x06)
 #define NRF_CTL_W4_DEVID_ACK  (0x07)
 #define NRF_CTL_W4_RF_ACK     (0x08)
+#define NRF_CTL_W4_WINDOW_ACK (0x09)
+// gstats.ack_us[] has a histogram for each W4 state
+#if NRF_ACK_STATES != NRF_CTL_W4_WINDOW_ACK
+#error NRF_ACK_STATES does not match the NRF_CTL_W4_xxx states
+#endif
+
+// Windowed OTA packet flags
+#define OTA_FLAG_ERASE        (0x01) // Erase the row, latch the first half
+#define OTA_FLAG_PROGRAM      (0x02) // Latch the second half, write the row
+
+// Broadcast OTA (0x8A) operations, see nrf_fleetflash()
+#define FLEET_OP_JOIN         (0x01)
+#define FLEET_OP_DATA         (0x02)
+#define FLEET_OP_POLL         (0x03)
+#define FLEET_OP_AUDIT        (0x04)
+
+// Broadcast OTA phases
+#define FLEET_JOIN            (0x00)
+#define FLEET_STREAM          (0x01)
+#define FLEET_POLL            (0x02)
+#define FLEET_REPAIR          (0x03)
+#define FLEET_AUDIT           (0x04)
+
+// Broadcast OTA device states
+#define FLEET_DEV_JOINING     (0x00)
+#define FLEET_DEV_ACTIVE      (0x01) // Joined, still missing records
+#define FLEET_DEV_READY       (0x02) // Every record in, AUDIT to come
+#define FLEET_DEV_DONE        (0x03) // Result reported
+#define FLEET_NACK_MANY       (0xFF) // Record missed by more than one device
 
 
 
@@ -78,10 +115,20 @@
 #define BIND_RFCHAN (0x03)
 #define BIND_NONE   (0xFF)
 
+#ifdef NRF_IRQ
+static volatile bool gtx_irq = false;
+
+// TX_DS interrupt - a block has left the TX FIFO
+ICACHE_RAM_ATTR void nrf_irq_handler(void) {
+   gtx_irq = true;
+}
+#endif
+
 // To do.. move into the Private Data and
 // accommodate multiple requests?
 //static File ota_file;
 File ota_files[MAX_P2P_PIPES];
+File fleet_file;
 
 // Device Id Conversion routines
 uint32_t txt2id(const char* str){
@@ -110,22 +157,73 @@ void WnrfDriver::setBaud(NrfBaud baud) {
    }
 }
 
+/* Radio channel number for an NrfChan id */
+static uint8_t rfChannel(NrfChan chanid) {
+   if ((uint8_t) chanid) {
+      // Channel - should be 70 to 82
+      return 68+(2* (uint8_t) chanid);
+   }
+   return 80;  // LabRat - Legacy devices used channel 80
+}
+
 /* Set radio frequencey */
 void WnrfDriver::setChan(NrfChan chanid) {
    conf_chanid = chanid;
+   grf_chan = rfChannel(chanid);
+   radio.setChannel(grf_chan);
+}
 
-   if ((uint8_t) chanid) {
-      // Channel - should be 70 to 82
-      radio.setChannel(68+(2* (uint8_t) chanid));
-   } else {
-      radio.setChannel(80);  // LabRat - Legacy devices used channel 80
+/* Retune only when moving to another universe's channel */
+void WnrfDriver::tuneRadio(uint8_t rf_chan) {
+   if (grf_chan != rf_chan) {
+      grf_chan = rf_chan;
+      radio.setChannel(rf_chan);
    }
 }
 
+/*
+ * The radio settings that change at run time are shadowed here and only
+ * written when they differ. Each RF24 call is several SPI transactions
+ * (stopListening 3, startListening 4, openWritingPipe 3, setAutoAck 2)
+ * and a run of p2p writes to one device used to redo all of them.
+ */
+void WnrfDriver::radioListen(bool listen) {
+   if (glistening != listen) {
+      glistening = listen;
+      if (listen) {
+         radio.startListening();   // EN_RXADDR_P0 = 0
+      } else {
+         radio.stopListening();    // EN_RXADDR_P0 = 1
+      }
+   }
+}
+
+/* Writing pipe address and its auto-ack, broadcasts must have it off */
+void WnrfDriver::radioTarget(uint64_t addr, bool autoack) {
+   if (gtx_addr != addr) {
+      gtx_addr = addr;
+      radio.openWritingPipe(addr);
+   }
+   if (gtx_autoack != autoack) {
+      gtx_autoack = autoack;
+      radio.setAutoAck(0, autoack);
+   }
+}
+
+/* Could anyone answer? If not the radio stays in TX between cycles */
+bool WnrfDriver::rxNeeded(void) {
+   if (gadmin || gfleet) return true;
+   for (int i=0; i<MAX_P2P_PIPES; i++) {
+      if (gPipes[i].state != NRF_CTL_NONE) return true;
+   }
+   return false;
+}
+
+/* Claim an idle pipe for a new session, a UI may run several at once */
 int WnrfDriver::storeContext(void * context) {
   int i;
   for (i=0;i<MAX_P2P_PIPES;i++) {
-     if (gPipes[i].context==NULL) {
+     if (gPipes[i].state==NRF_CTL_NONE) {
         gPipes[i].context = context;
         return i;
      }
@@ -133,19 +231,24 @@ int WnrfDriver::storeContext(void * context) {
   return -1;
 }
 
+/* The UI has gone, its sessions carry on without callbacks */
 int WnrfDriver::clearContext(void * context ) {
   int i;
+  int found = -1;
   for (i=0;i<MAX_P2P_PIPES;i++) {
      if (gPipes[i].context==context) {
         gPipes[i].context = NULL;
-        return i;
+        found = i;
      }
   }
-  return -1;
+  if (gfleet && (gfleet->context == context)) {
+     gfleet->context = NULL;
+  }
+  return found;
 }
 
 int WnrfDriver::getContext(uint8_t pipeid, void **context) {
-   if ((pipeid<0) || (pipeid>(MAX_P2P_PIPES-1))) {
+   if (pipeid<MAX_P2P_PIPES) {
       *context = gPipes[pipeid].context;
       return 1;
    }
@@ -159,19 +262,34 @@ int WnrfDriver::begin() {
 
 
 // E1.31 addresses (Legacy and New)
-byte addr_legacy[] = {0x81, 0xF0, 0xF0, 0xF0, 0xF0};
+uint64_t addr_legacy = 0xF0F0F0F081;
 uint32_t addr_wnrf_bcast = 0xC0DE42;
 
 // Address of the WNRF server
 uint32_t addr_wnrf_ctrl = 0xC0DEC1;
 
-int WnrfDriver::begin(NrfBaud baud, NrfChan chanid, int chan_size) {
+// Broadcast OTA data, clients listen once they have JOINed
+uint32_t addr_wnrf_fleet = 0xC0DEF1;
+
+/*
+ * Full mode may drive several universes (512 channels each), universe N
+ * goes out on the N'th RF channel above chanid. They share the one radio,
+ * taking turns a cycle at a time. Only the blocks holding the first
+ * chan_size channels are sent, a 96 channel install cycles 4 blocks.
+ *
+ * With shared set every universe goes out on chanid itself and the block
+ * header carries the universe as well, (universe<<5)|block. Universe 0
+ * headers are unchanged, clients of the single universe layout see their
+ * blocks as before (and must ignore headers above 16).
+ */
+int WnrfDriver::begin(NrfBaud baud, NrfChan chanid, int chan_size, uint8_t universes, bool shared) {
     byte NrfRxAddress[] = {0xFF,0x3A,0x66,0x65,0x76};
     int alloc_size = 32;
 
     // Async Functions - callback context
     nrf_async_otaflash=NULL;
     nrf_async_devlist=NULL;
+    nrf_async_autochan=NULL;
 
     // These aren't done yet
     nrf_async_rfchan=NULL;
@@ -179,24 +297,83 @@ int WnrfDriver::begin(NrfBaud baud, NrfChan chanid, int chan_size) {
     nrf_async_startaddr=NULL;
 
 
-    gnum_channels = chan_size;
     gnext_packet = 0;
+    gtx_mask = 0;
+    gtx_blocks = 0;
+    gzip_count = gzip_next = 0;
+    gfec_count = gfec_next = 0;
+    glatch_pending = false;
+    gtx_inflight = 0;
+    gtx_active = false;
+
+    glegacy = (chan_size == 32);
+    if (glegacy || (universes < 1)) {
+       universes = 1;
+    }
+    if (universes > NRF_MAX_UNIVERSES) {
+       universes = NRF_MAX_UNIVERSES;
+    }
+    gshared_chan = shared && !glegacy;
+    if (!gshared_chan && ((uint8_t) chanid + universes - 1 > (uint8_t) NrfChan::NRFCHAN_G)) {
+       universes = (uint8_t) NrfChan::NRFCHAN_G - (uint8_t) chanid + 1;
+    }
+    if (!glegacy) {
+       // No more channels than the universes hold, no universe left empty
+       if ((chan_size < 1) || (chan_size > universes*512)) {
+          chan_size = universes*512;
+       }
+       universes = (chan_size + 511)/512;
+    }
+    gnum_channels = chan_size;
+    gnum_universes = universes;
+
+    // Frame layout for setValue()/setRange(), see WnrfDriver.h
+    glayout_hdr   = glegacy ? 0 : 1;
+    glayout_chans = glegacy ? 32 : 31;
+    glayout_mul   = glegacy ? 0 : NRF_DIV31_MUL;
+    gtx_universe = universes-1; // First cycle goes to universe 0
+
+    // Everything goes out on the first cycle
+    memset(_universe, 0, sizeof(_universe));
+    for (int u=0; u<universes; u++) {
+       uint16_t chans = (chan_size - u*512 > 512) ? 512 : chan_size - u*512;
+       _universe[u].rf_chan  = rfChannel(gshared_chan ? chanid : NrfChan((uint8_t) chanid + u));
+       _universe[u].blocks   = (chans + 30)/31;
+       _universe[u].tail_len = 1 + chans - (_universe[u].blocks-1)*31;
+       _universe[u].tx_dirty = (1UL<<_universe[u].blocks)-1;
+    }
+    gframe_ready = false;
+    if (!gkeepalive) gkeepalive = NRF_KEEPALIVE_MS;
+    if (!gdmx_share) gdmx_share = NRF_DMX_SHARE;
     gadmin = false; //Never default to ADMIN mode
 
-    gdevice_count = 0;
     gbeacon_active = false;
+    gsession_next = 0;
+    gscan_on = gscan_dwell = false;
+    gmigrate_rf = 0;
+    gbest_chan = chanid;
+    gbest_count = 0;
+    gautochan_time = millis();
+    updateCompress();
+    if (gfleet) fleetEnd();
+    resetStats();
 
     for (int i=0; i<MAX_P2P_PIPES;i++) {
        gPipes[i].state   = NRF_CTL_NONE;
        gPipes[i].context = NULL;
        gPipes[i].bind_reason = BIND_NONE;
+       gPipes[i].win = NULL;
        gPipes[i].rxaddr = addr_wnrf_ctrl&0xFFFF00 | (i+2)&0xFF;
     }
 
     /* Allocate the Buffer Space */
     if (_dmxdata) free(_dmxdata);
-    if (chan_size >32) {
-       alloc_size=529; // # space for 1 byte header on 31 byte payloads
+    if (_txdata) free(_txdata);
+    _txdata = NULL;
+    if (!glegacy) {
+       // # space for 1 byte header on 31 byte payloads, per universe
+       // (the last universe only as far as its last block)
+       alloc_size=(universes-1)*NRF_UNIVERSE_BYTES + _universe[universes-1].blocks*32;
        gstart_time = micros();
     } else {
        gstart_time = millis();
@@ -204,18 +381,25 @@ int WnrfDriver::begin(NrfBaud baud, NrfChan chanid, int chan_size) {
 
     // Init all state timers
     gbeacon_timeout=gbeacon_bind_timeout=gbeacon_client_response_timeout= millis();
+    gcommit_time = millis();
 
-
-    if (_dmxdata = static_cast<uint8_t *>(malloc(alloc_size))) {
+    if ((_dmxdata = static_cast<uint8_t *>(malloc(alloc_size))) &&
+        (_txdata  = static_cast<uint8_t *>(malloc(alloc_size)))) {
         memset(_dmxdata, 0, alloc_size);
     } else {
         return false;
     }
 
     // Prepopulate the Payload # index packets
-    for (int i=0; i<chan_size;i+=32) {
-        _dmxdata[i] = i/32;
+    if (!glegacy) {
+        for (int i=0; i<alloc_size;i+=32) {
+            _dmxdata[i] = (i%NRF_UNIVERSE_BYTES)/32;
+            if (gshared_chan) {
+                _dmxdata[i] |= (i/NRF_UNIVERSE_BYTES)<<NRF_HDR_UNIVERSE;
+            }
+        }
     }
+    memcpy(_txdata, _dmxdata, alloc_size);
 
     /* NRF Init */
     radio.begin();
@@ -231,19 +415,41 @@ int WnrfDriver::begin(NrfBaud baud, NrfChan chanid, int chan_size) {
     // Power Level - to be added as CONFIG option
     radio.setPALevel(RF24_PA_MAX);
 
-    if (chan_size == 32) { // Legacy Mode
+#ifdef NRF_DYNAMIC_PAYLOAD
+    if (!glegacy) {
+       radio.enableDynamicPayloads();
+    }
+#endif
+
+    if (glegacy) { // Legacy Mode
        radio.setAddressWidth(5);
-       radio.openWritingPipe(addr_legacy);
+       gtx_addr = addr_legacy;
     } else {
        radio.setAddressWidth(3);
-       radio.openWritingPipe(addr_wnrf_bcast);
+       gtx_addr = addr_wnrf_bcast;
        radio.openReadingPipe(1,addr_wnrf_ctrl);
        radio.setAutoAck(1,false); // Disable broadcast Rx
     }
+    radio.openWritingPipe(gtx_addr);
+
+    // Session pipes keep their address, open them once rather than per BIND
+    for (int i=0; i<MAX_P2P_PIPES; i++) {
+       radio.openReadingPipe(i+2,gPipes[i].rxaddr);
+       radio.setAutoAck(i+2,true);
+    }
 
     radio.setAutoAck(0,false); // Disable for E1.31 broadcast
+    gtx_autoack = false;
+
+#ifdef NRF_IRQ
+    // Only TX complete drives the IRQ line, RX is polled from checkRx()
+    radio.maskIRQ(false, true, true);
+    pinMode(NRF_IRQ, INPUT);
+    attachInterrupt(digitalPinToInterrupt(NRF_IRQ), nrf_irq_handler, FALLING);
+#endif
 
     radio.startListening();
+    glistening = true;
     printf_begin();
 
     // Default counters and state for the LED output
@@ -252,9 +458,116 @@ int WnrfDriver::begin(NrfBaud baud, NrfChan chanid, int chan_size) {
     return true;
 }
 
+/*
+ * Percentage of the air time DMX keeps while in admin mode, the gaps
+ * between cycles are left for the beacon and device sessions.
+ */
+void WnrfDriver::setDmxShare(uint8_t pct) {
+    if ((pct < NRF_DMX_SHARE_MIN) || (pct > 100)) pct = NRF_DMX_SHARE;
+    gdmx_share = pct;
+}
+
+/*
+ * Auto channel mode (NRF_AUTOCHAN_xxx). The Wi-Fi channel is the one the
+ * ESP is on, it is scored as interference the scanner cannot see while
+ * we are transmitting. Legacy mode stays on channel 80.
+ */
+void WnrfDriver::setAutoChan(uint8_t mode, uint8_t wifi_chan) {
+    if (mode > NRF_AUTOCHAN_MIGRATE) mode = NRF_AUTOCHAN_OFF;
+    gautochan = mode;
+    gwifi_chan = (wifi_chan <= 14) ? wifi_chan : 0;
+    if (gautochan) gscan_on = true; // Scoring needs the scanner running
+}
+
+/* Compressed packets (NRF_ZIP_xxx), the registry decides in AUTO */
+void WnrfDriver::setCompress(uint8_t mode) {
+    gcompress = (mode <= NRF_ZIP_ON) ? mode : NRF_ZIP_OFF;
+    updateCompress();
+}
+
+/* End every cycle with a frame latch for the clients to apply it on */
+void WnrfDriver::setLatch(bool latch) {
+    glatch = latch;
+}
+
+/* Parity blocks per cycle, 0 for none. Parity implies the latch */
+void WnrfDriver::setFec(uint8_t groups) {
+    gfec_groups = (groups <= NRF_FEC_MAX) ? groups : NRF_FEC_MAX;
+}
+
+/* Longest time an unchanged block goes without being resent */
+void WnrfDriver::setKeepAlive(uint16_t ms) {
+    gkeepalive = ms ? ms : NRF_KEEPALIVE_MS;
+}
+
+void WnrfDriver::resetStats(void) {
+    memset(&gstats, 0, sizeof(gstats));
+    gstats.since = millis();
+}
+
+/* JSON/log name of gstats.ack_us[index], index = NRF_CTL_W4_xxx - 1 */
+const char * WnrfDriver::ackStateName(uint8_t index) {
+    static const char * const names[NRF_ACK_STATES] = {
+        "bind", "setup", "write", "commit", "audit", "chan", "devid", "rf", "window"
+    };
+    return (index < NRF_ACK_STATES) ? names[index] : "";
+}
+
+/*
+ * Blocking write with the timing and failure counts kept, for everything
+ * but the full mode DMX stream. pipe >= 0 marks a packet to a bound
+ * device, its ACK round trip is timed from here.
+ */
+bool WnrfDriver::txWrite(const void *buf, bool multicast, int8_t pipe) {
+    uint32_t start = micros();
+    bool ok = radio.write(buf, 32, multicast);
+    uint32_t end = micros();
+
+    nrfHistAdd(&gstats.write_us, end - start);
+    gstats.tx_packets++;
+    if (!ok) gstats.tx_fail++;
+    if (pipe >= 0) gPipes[pipe].txTime = end;
+    return ok;
+}
+
+/* Beacon while in admin and there is a pipe free for whoever answers */
+void WnrfDriver::updateBeacon(void) {
+    bool idle = false;
+    for (int i=0; i<MAX_P2P_PIPES; i++) {
+        idle |= (gPipes[i].state == NRF_CTL_NONE);
+    }
+    gbeacon_active = gadmin && idle;
+}
+
+/* Session on this pipe is over (done, failed or timed out), free the pipe */
+void WnrfDriver::endSession(uint8_t pipe) {
+    tPipeInfo *pid = &gPipes[pipe];
+
+    closeWindow(pipe);
+    pid->state = NRF_CTL_NONE;
+    pid->bind_reason = BIND_NONE;
+    pid->context = NULL;
+    updateBeacon();
+}
+
+/* The device already has a session on one of the pipes? */
+bool WnrfDriver::deviceBusy(tDevId devId) {
+    for (int i=0; i<MAX_P2P_PIPES; i++) {
+        if ((gPipes[i].state != NRF_CTL_NONE) && (gPipes[i].txaddr == devId)) {
+            return true;
+        }
+    }
+    for (int i=0; gfleet && (i<gfleet->count); i++) {
+        if ((gfleet->dev[i].dev_id == devId) && (gfleet->dev[i].state != FLEET_DEV_DONE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void WnrfDriver::enableAdmin(void) {
     gadmin = true;
-    gbeacon_active = true;
+    updateBeacon();
     digitalWrite(LED_NRF,HIGH);
     sendBeacon();
 }
@@ -266,113 +579,752 @@ void WnrfDriver::disableAdmin(void) {
 }
 
 /*
- * Call from the MAIN loop to output a single payload/packet.
- * Passes a pointer to the next FRAME in the _dmxdata buffer,
- * to the RF24 pipeline
+ * Is there room in the TX FIFO for another block?
+ * With the IRQ line wired we only go to SPI once the radio reports a
+ * block has been sent, otherwise the FIFO status is polled.
+ */
+bool WnrfDriver::txFifoFree(void) {
+#ifdef NRF_IRQ
+    if (gtx_inflight < NRF_TX_FIFO) return true;
+    if (!gtx_irq) return false;
+
+    bool tx_ok, tx_fail, rx_ready;
+    gtx_irq = false;
+    radio.whatHappened(tx_ok, tx_fail, rx_ready); // Clear TX_DS
+#endif
+    if (radio.isFifo(true, false)) return false;  // TX FIFO full
+#ifdef NRF_IRQ
+    gtx_inflight = NRF_TX_FIFO-1;
+#endif
+    return true;
+}
+
+/*
+ * Next packet of the cycle, in order: compressed runs, plain blocks,
+ * parity blocks and the latch. Only called while txPending(). Every
+ * kind is counted, a client counts each one it receives.
+ */
+const uint8_t * WnrfDriver::txNext(uint8_t *len) {
+    _universe[gtx_universe].packets++;
+    if (gzip_next < gzip_count) {
+        *len = gzip_len[gzip_next];
+        return gzip_pkt[gzip_next++];
+    }
+    if (gtx_mask) {
+        gnext_packet = __builtin_ctz(gtx_mask);
+        gtx_mask &= ~(1UL<<gnext_packet);
+        *len = blockLen(gtx_universe, gnext_packet);
+        return &(_txdata[gtx_universe*NRF_UNIVERSE_BYTES+gnext_packet*32]);
+    }
+    if (gfec_next < gfec_count) {
+        *len = 32;
+        return gfec_pkt[gfec_next++];
+    }
+    glatch_pending = false;
+    glatch_pkt[1] = _universe[gtx_universe].frame++;
+    *len = latchLen();
+    return glatch_pkt;
+}
+
+/*
+ * Keep the TX FIFO topped up with the remaining blocks of the cycle.
+ * CE stays high so queued blocks go out back to back (Standby-II), and
+ * the radio only returns to RX once the whole cycle has been sent.
+ */
+void WnrfDriver::txService(void) {
+    while (txPending() && txFifoFree()) {
+        uint32_t start = micros();
+        uint8_t len;
+        const uint8_t *pkt = txNext(&len);
+        radio.startFastWrite(pkt, len, 1);
+        nrfHistAdd(&gstats.load_us, micros() - start);
+        gstats.tx_blocks++;
+        gtx_inflight++;
+
+        if (--gled_count == 0) {
+            gled_state ^=1;
+            digitalWrite(LED_NRF, gled_state); // Blink when transmitting
+            gled_count = 44*17; // Mode 1: 44 DMX universe fps target
+        }
+    }
+
+    if (!txPending() && radio.isFifo(true, true)) { // Cycle sent
+        nrfHistAdd(&gstats.cycle_us, micros() - gcycle_start);
+        gstats.cycles[gtx_universe]++;
+        if (rxNeeded()) {
+            tuneRadio(_universe[0].rf_chan); // Back home for client replies
+            radioListen(true);
+        }
+        gtx_active = false;
+    }
+}
+
+/*
+ * Finish any universe in progress. The radio is left in TX standby, the
+ * caller decides where it goes next (radioListen() for RX)
+ */
+void WnrfDriver::txFlush(void) {
+    if (gtx_active) {
+        while (txPending()) {
+            uint8_t len;
+            const uint8_t *pkt = txNext(&len);
+            radio.writeFast(pkt, len, 1);
+            gstats.tx_blocks++;
+        }
+        radio.txStandBy();
+        nrfHistAdd(&gstats.cycle_us, micros() - gcycle_start);
+        gstats.cycles[gtx_universe]++;
+        gtx_active = false;
+        gtx_inflight = 0;
+    }
+}
+
+/*
+ * Point the radio at one device (or the control address) for a blocking
+ * write. The universe on air is finished first, the next DMX cycle puts
+ * the broadcast address back.
+ */
+void WnrfDriver::p2pBegin(tDevId addr, bool autoack) {
+    if (gscan_dwell) scanAbort();
+    txFlush();
+    radioListen(false);
+    tuneRadio(_universe[0].rf_chan);
+    radioTarget(addr, autoack);
+}
+
+/* Back to RX for the reply. Address and auto-ack stay as they are, a
+ * following write to the same device needs no SPI to set them up again */
+void WnrfDriver::p2pEnd(void) {
+    radioListen(true);
+}
+
+/* Payload length of a block, the last one of a universe may be short */
+uint8_t WnrfDriver::blockLen(uint8_t universe, uint8_t block) {
+#ifdef NRF_DYNAMIC_PAYLOAD
+    if (block == _universe[universe].blocks-1) {
+        return _universe[universe].tail_len;
+    }
+#else
+    (void) universe;
+    (void) block;
+#endif
+    return 32;
+}
+
+/*
+ * Run length code one 31 channel block into dst, 0 when it needs more
+ * than room bytes. Token 0x00-0x7F: that many plus one literal bytes
+ * follow. Token 0x80-0xFF: the next byte repeated (token-0x80)+2 times.
+ */
+static uint8_t zipBlock(const uint8_t *src, uint8_t *dst, uint8_t room) {
+    uint8_t in = 0, out = 0;
+
+    while (in < 31) {
+        uint8_t run = 1;
+        while ((in+run < 31) && (src[in+run] == src[in])) run++;
+
+        if (run >= 3) {
+            if (out+2 > room) return 0;
+            dst[out++] = 0x80 + run - 2;
+            dst[out++] = src[in];
+            in += run;
+        } else {
+            // Literal up to the next run of three
+            uint8_t lit = 0;
+            while ((in+lit < 31) && !((in+lit+2 < 31) && (src[in+lit] == src[in+lit+1])
+                                      && (src[in+lit] == src[in+lit+2]))) lit++;
+            if (out+1+lit > room) return 0;
+            dst[out++] = lit-1;
+            memcpy(&dst[out], &src[in], lit);
+            out += lit;
+            in  += lit;
+        }
+    }
+    return out;
+}
+
+/*
+ * Compressed full mode. Runs of two or more scheduled blocks that run
+ * length code into one packet go out as NRF_HDR_ZIP packets, a zero or
+ * flat universe fits in two. Blocks that don't pack stay in gtx_mask and
+ * go out as they are. Each block decodes to exactly 31 channels.
+ */
+void WnrfDriver::zipSchedule(uint8_t universe) {
+    tNrfUniverse *uni = &_universe[universe];
+    const uint8_t *base = &_txdata[universe*NRF_UNIVERSE_BYTES];
+    uint32_t mask = gtx_mask;
+
+    gzip_count = gzip_next = 0;
+    while (mask && (gzip_count < NRF_ZIP_MAX)) {
+        uint8_t first = __builtin_ctz(mask);
+        uint8_t *pkt = gzip_pkt[gzip_count];
+        uint8_t len = 3, blocks = 0;
+
+        while ((first+blocks < uni->blocks) && (mask & (1UL<<(first+blocks)))) {
+            uint8_t used = zipBlock(&base[(first+blocks)*32+1], &pkt[len], 32-len);
+            if (!used) break;
+            len += used;
+            blocks++;
+        }
+
+        if (blocks < 2) { // Sent as it is
+            mask &= ~(1UL<<first);
+            continue;
+        }
+        pkt[0] = NRF_HDR_ZIP | (gshared_chan ? universe<<NRF_HDR_UNIVERSE : 0);
+        pkt[1] = first;
+        pkt[2] = blocks;
+#ifdef NRF_DYNAMIC_PAYLOAD
+        gzip_len[gzip_count] = len;
+#else
+        memset(&pkt[len], 0, 32-len);
+        gzip_len[gzip_count] = 32;
+#endif
+        gzip_count++;
+        uint32_t run = ((1UL<<blocks)-1)<<first;
+        mask &= ~run;
+        gtx_mask &= ~run;
+        gstats.tx_zipped += blocks;
+    }
+}
+
+/*
+ * Frame latch. Clients that know it hold the blocks they receive and
+ * apply them together when the latch arrives, so every pack on the
+ * universe changes at once. The frame number counts the universe's
+ * latches (see txNext()) and tells them a latch was missed, the block
+ * mask which blocks this cycle carried, so a missing block is seen.
+ * Older clients ignore it (header above 16).
+ */
+void WnrfDriver::latchSchedule(uint8_t universe, uint32_t mask) {
+    glatch_pkt[0] = NRF_HDR_LATCH | (gshared_chan ? universe<<NRF_HDR_UNIVERSE : 0);
+    glatch_pkt[1] = 0; // Numbered as it goes into the FIFO
+    glatch_pkt[2] = mask & 0xFF;
+    glatch_pkt[3] = (mask >> 8) & 0xFF;
+    glatch_pkt[4] = (mask >> 16) & 0xFF;
+    glatch_pkt[5] = gfec_groups;
+    memset(&glatch_pkt[NRF_LATCH_LEN], 0, 32-NRF_LATCH_LEN);
+    glatch_pending = true;
+}
+
+/*
+ * Parity blocks. The blocks of a cycle are split into gfec_groups
+ * interleaved groups (block % groups), so a burst of lost packets hits
+ * different groups, and each group gets one packet holding the XOR of
+ * its blocks' 31 channels: <NRF_HDR_FEC+group><Parity:31>. At the latch
+ * a client that missed one block of a group (the latch mask says which
+ * were sent) rebuilds it from the parity and the blocks it did get,
+ * rather than waiting for the block's next change or keep-alive. It
+ * works on the decoded blocks, so compressed runs are covered too.
+ */
+void WnrfDriver::fecSchedule(uint8_t universe, uint32_t mask) {
+    const uint8_t *base = &_txdata[universe*NRF_UNIVERSE_BYTES];
+
+    gfec_count = gfec_next = 0;
+    for (uint8_t group=0; group<gfec_groups; group++) {
+        uint8_t *pkt = gfec_pkt[gfec_count];
+        bool any = false;
+
+        memset(pkt, 0, 32);
+        for (uint8_t block=group; block<_universe[universe].blocks; block+=gfec_groups) {
+            if (!(mask & (1UL<<block))) continue;
+            for (uint8_t i=0; i<31; i++) {
+                pkt[1+i] ^= base[block*32+1+i];
+            }
+            any = true;
+        }
+        if (!any) continue;
+        pkt[0] = (NRF_HDR_FEC+group) | (gshared_chan ? universe<<NRF_HDR_UNIVERSE : 0);
+        gfec_count++;
+    }
+}
+
+/* Compress only when asked to, or when every device known can decode it */
+void WnrfDriver::updateCompress(void) {
+    bool zip = (gcompress == NRF_ZIP_ON);
+
+    if ((gcompress == NRF_ZIP_AUTO) && gdevice_count) {
+        zip = true;
+        for (int i=0; i<gdevice_count; i++) {
+            if (gdevices[i].info.apv < NRF_ZIP_APV) zip = false;
+        }
+    }
+    gzip = zip && !glegacy;
+}
+
+/*
+ * Pick the blocks for the next cycle: everything changed since it was
+ * last queued, plus any unchanged block due its keep-alive resend.
+ */
+uint32_t WnrfDriver::txSchedule(uint8_t universe) {
+    tNrfUniverse *uni = &_universe[universe];
+    uint32_t now  = millis();
+    uint32_t mask = uni->tx_dirty;
+
+    for (uint8_t i=0; i<uni->blocks; i++) {
+        if ((mask & (1UL<<i)) || (now - uni->last_sent[i] >= gkeepalive)) {
+            mask |= (1UL<<i);
+            uni->last_sent[i] = now;
+        }
+    }
+    uni->tx_dirty = 0;
+    return mask;
+}
+
+/*
+ * Bulk form of setValue() for the protocol receivers. The run is split
+ * into spans that stay inside one 31 channel block, so the block maths
+ * is done once per span rather than per channel, and each span is a
+ * single compare and copy into the radio frame layout.
+ */
+void WnrfDriver::setRange(uint16_t address, const uint8_t *data, uint16_t len) {
+    if (address >= gnum_channels) return;
+    if (len > gnum_channels - address) len = gnum_channels - address;
+
+    while (len) {
+        uint8_t  universe = address >> 9;    // 512 channels per universe
+        if (universe >= gnum_universes) break;
+        uint16_t channel = address & 0x1FF;
+        uint8_t  block   = (channel*glayout_mul) >> 16;
+        uint8_t  pos     = channel - block*glayout_chans;
+        uint16_t span    = glayout_chans - pos;
+
+        if (span > 512 - channel) span = 512 - channel; // Short last block
+        if (span > len) span = len;
+
+        uint8_t *dst = &_dmxdata[universe*NRF_UNIVERSE_BYTES+glayout_hdr+channel+block];
+        if (memcmp(dst, data, span)) {
+            memcpy(dst, data, span);
+            _universe[universe].dirty |= (1UL<<block);
+        }
+        address += span;
+        data    += span;
+        len     -= span;
+    }
+}
+
+/*
+ * Flag the end of a frame (DDP push, ZCPP sync, last E1.31 universe,
+ * effect step). The buffers are swapped at the start of the next cycle
+ * so a cycle never mixes two frames.
+ */
+void WnrfDriver::commit() {
+    gframe_ready = true;
+}
+
+/*
+ * Make the back buffer the one on air, then bring the new back buffer
+ * up to date by copying across only the blocks that changed.
+ */
+void WnrfDriver::swapFrame(void) {
+    uint8_t *temp = _txdata;
+    _txdata  = _dmxdata;
+    _dmxdata = temp;
+
+    // A legacy frame is block 0 of universe 0
+    for (uint8_t u=0; u<gnum_universes; u++) {
+        uint16_t base = u*NRF_UNIVERSE_BYTES;
+        uint32_t mask = _universe[u].dirty;
+        while (mask) {
+            uint8_t block = __builtin_ctz(mask);
+            mask &= ~(1UL<<block);
+            memcpy(&(_dmxdata[base+block*32]), &(_txdata[base+block*32]), 32);
+        }
+        _universe[u].tx_dirty |= _universe[u].dirty;
+        _universe[u].dirty = 0;
+    }
+    gframe_ready = false;
+    gcommit_time = millis();
+}
+
+/*
+ * Call from the MAIN loop to output the _txdata (front) buffer.
+ * Legacy mode sends its single payload per call. Full mode starts a
+ * cycle of the changed/keep-alive blocks and streams it through the
+ * TX FIFO, further calls while it is on air just keep the FIFO fed.
  */
 void WnrfDriver::show() {
-    if (!gadmin) {
-	/* Send the packet */
-        radio.stopListening();
-        radio.write(&(_dmxdata[gnext_packet*32]),32,1);
-
-        gled_count--;
-        if (gnum_channels == 32)
-            gstart_time = millis();
-        else {
-            gstart_time = micros();
-            gnext_packet = (gnext_packet+1)%17;
+    if (gscan_dwell) scanAbort();
+    if (gadmin && glegacy) return;
+
+    // Never swap mid cycle, and don't sit on changes from a source that
+    // does not mark its frames
+    if (!gtx_active) {
+        bool dirty = false;
+        for (uint8_t u=0; u<gnum_universes; u++) {
+            dirty |= (_universe[u].dirty != 0);
+        }
+        if (gframe_ready || (dirty && (millis() - gcommit_time > NRF_COMMIT_MS))) {
+            swapFrame();
         }
-        if (gled_count == 0) {
+    }
+
+    if (glegacy) {
+	/* Send the packet */
+        radioListen(false);
+        radioTarget(addr_legacy, false);
+        txWrite(&(_txdata[0]), true);
+        gstart_time = millis();
+
+        if (--gled_count == 0) {
             gled_state ^=1;
             digitalWrite(LED_NRF, gled_state); // Blink when transmitting
-            if (gnum_channels ==32)
-                gled_count =44;   // Legacy mode 44 single fps target
-            else
-                gled_count = 44*17; // Mode 1: 44 DMX universe fps target
+            gled_count =44;   // Legacy mode 44 single fps target
+        }
+        if (rxNeeded()) radioListen(true);
+        return;
+    }
+
+    if (!gtx_active) {
+        gstart_time = micros();
+
+        // Round robin over the universes, a cycle is one universe's blocks
+        gtx_mask = 0;
+        for (uint8_t i=0; (i<gnum_universes) && !gtx_mask; i++) {
+            if (++gtx_universe >= gnum_universes) gtx_universe = 0;
+            gtx_mask = txSchedule(gtx_universe);
+        }
+        gzip_count = gzip_next = 0;
+        gfec_count = gfec_next = 0;
+        glatch_pending = false;
+        if ((glatch || gfec_groups) && gtx_mask) { // Parity needs the latch mask
+            latchSchedule(gtx_universe, gtx_mask);
+            if (gfec_groups) fecSchedule(gtx_universe, gtx_mask);
         }
-        radio.startListening();
+        if (gzip) zipSchedule(gtx_universe);
+        gtx_blocks = __builtin_popcount(gtx_mask) + gzip_count + gfec_count + glatch_pending;
+        if (!gtx_blocks) {
+            gtx_blocks = 1; // Nothing to send, look again after one block slot
+            return;
+        }
+
+        radioListen(false); // Once per cycle, not per block
+        radioTarget(addr_wnrf_bcast, false); // Admin traffic may have moved it
+        tuneRadio(_universe[gtx_universe].rf_chan);
+#ifdef NRF_IRQ
+        // TX_DS from the previous universe holds the IRQ line low
+        bool tx_ok, tx_fail, rx_ready;
+        radio.whatHappened(tx_ok, tx_fail, rx_ready);
+        gtx_irq = false;
+#endif
+        gtx_active = true;
+        gtx_inflight = 0;
+        gcycle_start = micros();
     }
+    txService();
 }
 
-/* For the ESPixelStick visualation */
+/* For the ESPixelStick visualation - the frame on air */
 
 uint8_t* WnrfDriver::getData() {
-    return _dmxdata;
+    return _txdata;
 }
 
 
-/* Frequencey Scanner */
-
-#define num_nrfchannels 84
-uint8_t values[num_nrfchannels];
+/*
+ * Frequency scanner. While the UI is looking at the spectrum one channel
+ * is sampled at a time in the gaps between DMX cycles: the radio listens
+ * on it for NRF_SCAN_DWELL_US, the carrier detect is read and the radio
+ * goes back home for NRF_SCAN_GAP_US. Each sample is folded into a
+ * decaying energy map, so a sweep costs nothing more than a missed reply
+ * now and then. Admin sessions and the broadcast OTA are never interrupted.
+ */
 uint8_t* WnrfDriver::getNrfHistogram() {
-   int chanId, loopcount;
-   memset(values, 0, sizeof(values));
-   radio.stopListening();
+   gscan_on = true;
+   gscan_request = millis();
+   return gscan_map;
+}
 
-   loopcount = 2;
+/* Called from checkRx(), true while the radio is away on a sample */
+bool WnrfDriver::serviceScan(void) {
+   if (gscan_dwell) {
+      if (micros() - gscan_time < NRF_SCAN_DWELL_US) return true;
+
+      radioListen(false);
+      int32_t target = radio.testCarrier() ? 0xFFFF : 0;
+      tuneRadio(gscan_home);
+      radioListen(true);
+      gscan_dwell = false;
+      gscan_time = micros();
+
+      int32_t energy = gscan_energy[gscan_chan];
+      energy += (target - energy) >> NRF_SCAN_DECAY;
+      gscan_energy[gscan_chan] = energy;
+      gscan_map[gscan_chan] = energy >> 8;
+      if (++gscan_chan >= NRF_SCAN_CHANNELS) gscan_chan = 0;
+      return false;
+   }
 
-   while (loopcount--) {
-      for (chanId=0;chanId<num_nrfchannels;chanId++) {
-         radio.setChannel(chanId);
-         radio.startListening();
-         delayMicroseconds(128);
-         radio.stopListening();
+   if (!gscan_on) return false;
+   if (!gautochan && (millis() - gscan_request > NRF_SCAN_HOLD_MS)) {
+      gscan_on = false;  // The UI has moved on, keep the map for next time
+      return false;
+   }
+   if (micros() - gscan_time < NRF_SCAN_GAP_US) return false;
 
-         if (radio.testCarrier()) {
-            ++values[chanId];
-         }
+   // A reply missed mid session costs a retry, leave the channel alone
+   if (gfleet) return false;
+   for (int i=0; i<MAX_P2P_PIPES; i++) {
+      if (gPipes[i].state != NRF_CTL_NONE) return false;
+   }
+
+   gscan_home = grf_chan;
+   radioListen(false);
+   tuneRadio(gscan_chan);
+   radioListen(true);
+   gscan_dwell = true;
+   gscan_time = micros();
+   return true;
+}
+
+/* The radio is needed to transmit, drop the sample under way */
+void WnrfDriver::scanAbort(void) {
+   radioListen(false);
+   tuneRadio(gscan_home);
+   radioListen(true);
+   gscan_dwell = false;
+   gscan_time = micros();
+}
+
+/* Carrier detect rate on one RF channel, 0..100% */
+uint8_t WnrfDriver::scanEnergy(uint8_t rf_chan) {
+   if (rf_chan >= NRF_SCAN_CHANNELS) return 0;
+   return ((uint32_t) gscan_energy[rf_chan]*100) >> 16;
+}
+
+/*
+ * Score the universes chanid would carry, lower is cleaner. At 2Mbps a
+ * universe fills its channel and the next, the neighbours count half.
+ * Our own Wi-Fi (22MHz wide) and the client loss seen while we were
+ * last there are added on top.
+ */
+uint16_t WnrfDriver::scoreChan(NrfChan chanid) {
+   uint8_t  universes = gshared_chan ? 1 : gnum_universes;
+   uint16_t score = 0;
+
+   for (uint8_t u=0; u<universes; u++) {
+      uint8_t rf = rfChannel(NrfChan((uint8_t) chanid + u));
+      score += scanEnergy(rf) + scanEnergy(rf+1);
+      score += (scanEnergy(rf-1) + scanEnergy(rf+2))/2;
+      if (gwifi_chan) {
+         uint8_t wifi = (gwifi_chan == 14) ? 84 : 7 + 5*gwifi_chan;
+         if ((rf+1+11 >= wifi) && (rf <= wifi+11)) score += NRF_AUTOCHAN_WIFI;
       }
    }
+   return score + gchan_loss[(uint8_t) chanid];
+}
 
-   // Restore the setup
-   setChan(conf_chanid);
+/*
+ * Called from checkRx(). Every NRF_AUTOCHAN_MS the channels are scored
+ * from the scanner, the Wi-Fi channel and the client loss. A
+ * channel that beats the current one by NRF_AUTOCHAN_MARGIN for
+ * NRF_AUTOCHAN_CONFIRM scorings becomes the best, and in MIGRATE mode
+ * the clients are sent there before the controller follows. Only one
+ * RF channel can be moved this way, the registry does not know which
+ * universe a client listens to.
+ */
+void WnrfDriver::serviceAutoChan(void) {
+   if (!gautochan || glegacy) return;
+   if (gmigrate_rf) {
+      migrateChan();
+      return;
+   }
+   if (millis() - gautochan_time < NRF_AUTOCHAN_MS) return;
+   gautochan_time = millis();
+
+   // Clients only answer in admin mode, so loss is only known after beacons
+   uint8_t current = (uint8_t) conf_chanid;
+   // Client packet loss where they report it, missed beacons otherwise
+   if (gdevice_count && (gbeacon_count != gautochan_beacon)) {
+      uint32_t loss = 0;
+      for (int i=0; i<gdevice_count; i++) {
+         const tDeviceEntry *dev = &gdevices[i];
+         loss += (dev->loss != NRF_LOSS_UNKNOWN) ? dev->loss : 100 - replyRate(dev);
+      }
+      gchan_loss[current] = (gchan_loss[current] + loss/gdevice_count)/2;
+   }
+   gautochan_beacon = gbeacon_count;
+
+   uint8_t universes = gshared_chan ? 1 : gnum_universes;
+   uint8_t best = current;
+   memset(gchan_score, 0, sizeof(gchan_score));
+   for (uint8_t c=(uint8_t) NrfChan::NRFCHAN_A; c+universes-1<=(uint8_t) NrfChan::NRFCHAN_G; c++) {
+      if (c != current) {
+         gchan_loss[c] -= gchan_loss[c] >> 2; // Loss seen long ago is forgiven
+      }
+      gchan_score[c] = scoreChan(NrfChan(c));
+   }
+   if (!gchan_score[current]) { // Legacy channel, outside the range above
+      gchan_score[current] = scoreChan(conf_chanid);
+   }
+   for (uint8_t c=(uint8_t) NrfChan::NRFCHAN_A; c+universes-1<=(uint8_t) NrfChan::NRFCHAN_G; c++) {
+      if (gchan_score[c] < gchan_score[best]) best = c;
+   }
 
-   radio.startListening();
-   return values;
+   if ((best == current) || (gchan_score[best] + NRF_AUTOCHAN_MARGIN >= gchan_score[current])) {
+      gbest_chan = conf_chanid;
+      gbest_count = 0;
+      return;
+   }
+   gbest_count = (NrfChan(best) == gbest_chan) ? gbest_count+1 : 1;
+   gbest_chan = NrfChan(best);
+
+   if ((gautochan == NRF_AUTOCHAN_MIGRATE) && (gbest_count >= NRF_AUTOCHAN_CONFIRM)
+       && ((gnum_universes == 1) || gshared_chan)) {
+      Serial.print("Auto channel: moving to ");
+      Serial.println(rfChannel(gbest_chan));
+      gmigrate_rf = rfChannel(gbest_chan);
+      gmigrate_next = 0;
+   }
 }
 
+/* Tell every client in the registry, then move once they have answered */
+void WnrfDriver::migrateChan(void) {
+   for (int i=0; i<gdevice_count; i++) {
+      tDevId devId = gdevices[i].info.dev_id;
+      if (devId < gmigrate_next) continue;
+      if (deviceBusy(devId)) {
+         Serial.print("Auto channel: busy, left behind ");
+         Serial.println(devId, HEX);
+      } else if (nrf_rfchan_update(devId, gmigrate_rf, NULL) < 0) {
+         return; // No pipe free, carry on next time
+      }
+      gmigrate_next = devId+1;
+   }
+   for (int i=0; i<MAX_P2P_PIPES; i++) {
+      if ((gPipes[i].state != NRF_CTL_NONE) && (gPipes[i].bind_reason == BIND_RFCHAN)) return;
+   }
+
+   conf_chanid = gbest_chan;
+   for (uint8_t u=0; u<gnum_universes; u++) {
+      _universe[u].rf_chan  = rfChannel(gshared_chan ? conf_chanid : NrfChan((uint8_t) conf_chanid + u));
+      _universe[u].tx_dirty = (1UL<<_universe[u].blocks)-1;
+   }
+   radioListen(false);
+   tuneRadio(_universe[0].rf_chan);
+   radioListen(true);
+
+   // Reply rates start over on the new channel
+   for (int i=0; i<gdevice_count; i++) {
+      gdevices[i].first_beacon = gbeacon_count+1;
+      gdevices[i].replies = 0;
+      gdevices[i].strong = 0;
+   }
+   gautochan_beacon = gbeacon_count;
+   gmigrate_rf = 0;
+   gbest_count = 0;
+   gautochan_time = millis();
+
+   if (nrf_async_autochan) {
+      nrf_async_autochan(conf_chanid);
+   }
+}
+
+/*
+ * Push the registry changes to the UI, at most once a second. Devices that
+ * stopped answering the beacon are flagged gone, pushed, then dropped.
+ * Nothing ages while the beacon is off, the registry survives leaving admin.
+ */
 void WnrfDriver::sendDeviceList(void) {
-  bool send_data = false;
+   uint16_t events = 0;
+   uint16_t keep = 0;
 
-   if (gadmin == true) {
-      // Throttle to once a second
-      if (millis()-gbeacon_client_response_timeout > 1000) {
-         if (gdevice_count) {
-           send_data = true;
-         }
-      } else {
-         if (gdevice_count>8) {
-            send_data = true;
-         }
+   if (millis()-gbeacon_client_response_timeout < 1000) return;
+   gbeacon_client_response_timeout = millis();
+
+   for (int i=0;i<gdevice_count;i++) {
+      tDeviceEntry *dev = &gdevices[i];
+      if ((uint16_t)(gbeacon_count - dev->last_beacon) > NRF_DEVICE_MISSED) {
+         dev->event = NRF_DEV_GONE;
       }
-      if (send_data) {
-        if (nrf_async_devlist) {
-           nrf_async_devlist(gdevice_list,gdevice_count);
-           gbeacon_client_response_timeout = millis();
-           Serial.print("Sending list of ");
-           Serial.print(gdevice_count);
-           Serial.println(" devices.");
-        }
-        gdevice_count = 0;
+      if (dev->event) events++;
+   }
+   if (!events) return;
+
+   if (nrf_async_devlist) {
+      nrf_async_devlist(gdevices, gdevice_count);
+   }
+
+   // Events delivered, close up the gaps left by the devices that have gone
+   for (int i=0;i<gdevice_count;i++) {
+      if (gdevices[i].event != NRF_DEV_GONE) {
+         gdevices[i].event = NRF_DEV_NONE;
+         gdevices[keep++] = gdevices[i];
       }
-   } else {
-     gdevice_count = 0;
    }
+   gdevice_count = keep;
+   updateCompress(); // New devices, or the last old one gone
 }
 
-void WnrfDriver::parseNrf_x88(uint8_t *data) {
-   if (gdevice_count<10) { // Prevent Buffer Overrun
-      char tempid[8];
-      tDeviceInfo *temp = &(gdevice_list[gdevice_count++]);
+/* Registry index of devId, or -(insertion point)-1 when not there */
+int WnrfDriver::findDevice(tDevId devId) {
+   int lo = 0;
+   int hi = gdevice_count-1;
 
-      temp->dev_id = data[3]<<16|data[2]<<8|data[1]; // Device Id
-      temp->type   = data[4];           // Device Type
-      temp->blv    = data[5];           // Boot Loader Version */
-      temp->apm    = data[6];           // App Magic Number */
-      temp->apv    = data[7];           // Boot Loader Version */
-      temp->start  = data[8]|(data[9]<<8);
+   while (lo <= hi) {
+      int mid = (lo+hi)/2;
+      if (gdevices[mid].info.dev_id == devId) return mid;
+      if (gdevices[mid].info.dev_id < devId) {
+         lo = mid+1;
+      } else {
+         hi = mid-1;
+      }
+   }
+   return -lo-1;
+}
+
+const tDeviceEntry * WnrfDriver::getDevice(tDevId devId) {
+   int index = findDevice(devId);
+   return (index >= 0) ? &gdevices[index] : NULL;
+}
+
+/* Percentage of the beacons answered since the device was first heard */
+uint8_t WnrfDriver::replyRate(const tDeviceEntry *dev) {
+   uint16_t sent = gbeacon_count - dev->first_beacon + 1;
+   return (dev->replies >= sent) ? 100 : (dev->replies*100)/sent;
+}
+
+/* Beacon reply, strong when the RPD saw it above -64dBm */
+void WnrfDriver::parseNrf_x88(uint8_t *data, bool strong) {
+   tDeviceInfo info;
+   tDeviceEntry *dev;
+   int index;
+
+   info.dev_id = data[3]<<16|data[2]<<8|data[1]; // Device Id
+   info.type   = data[4];           // Device Type
+   info.blv    = data[5];           // Boot Loader Version */
+   info.apm    = data[6];           // App Magic Number */
+   info.apv    = data[7];           // App Version */
+   info.start  = data[8]|(data[9]<<8);
+
+   index = findDevice(info.dev_id);
+   if (index < 0) {
+      index = -index-1;
+      if (gdevice_count >= gdevice_alloc) {
+         tDeviceEntry *grown = NULL;
+         if (gdevice_alloc < NRF_DEVICE_MAX) {
+            grown = static_cast<tDeviceEntry *>(realloc(gdevices, (gdevice_alloc+NRF_DEVICE_GROW)*sizeof(tDeviceEntry)));
+         }
+         if (!grown) {
+            Serial.println("Device registry full");
+            return;
+         }
+         gdevices = grown;
+         gdevice_alloc += NRF_DEVICE_GROW;
+      }
+      memmove(&gdevices[index+1], &gdevices[index], (gdevice_count-index)*sizeof(tDeviceEntry));
+      gdevice_count++;
+
+      dev = &gdevices[index];
+      memset(dev, 0, sizeof(*dev));
+      dev->info = info;
+      dev->first_beacon = gbeacon_count;
+      dev->last_beacon  = gbeacon_count-1;
+      dev->link  = 10;
+      dev->loss  = NRF_LOSS_UNKNOWN;
+      memset(dev->loss_hist, NRF_LOSS_UNKNOWN, sizeof(dev->loss_hist));
+      dev->event = NRF_DEV_NEW;
+      if (info.apv < NRF_ZIP_APV) updateCompress(); // Cannot decode, stop now
 
       Serial.print("** Client Device detected [");
       for (int i=1;i<4;i++) {
@@ -381,8 +1333,74 @@ void WnrfDriver::parseNrf_x88(uint8_t *data) {
          Serial.print(hex);
       }
       Serial.println("]");
+   } else {
+      dev = &gdevices[index];
+      if ((dev->info.type != info.type) || (dev->info.blv != info.blv) ||
+          (dev->info.apm != info.apm) || (dev->info.apv != info.apv) ||
+          (dev->info.start != info.start) || (dev->event == NRF_DEV_GONE)) {
+         dev->info = info;
+         if (dev->event != NRF_DEV_NEW) dev->event = NRF_DEV_CHANGED;
+         updateCompress();
+      }
+   }
+
+   if (dev->last_beacon != gbeacon_count) {
+      dev->replies++; // Once per beacon
+      if (strong) dev->strong++;
+      if (data[10] == NRF_TELEMETRY_V1) parseTelemetry(dev, data);
+   }
+   dev->last_seen = millis();
+   dev->last_beacon = gbeacon_count;
+
+   // Link quality only counts as a change in 10% steps
+   if (replyRate(dev)/10 != dev->link) {
+      dev->link = replyRate(dev)/10;
+      if (!dev->event) dev->event = NRF_DEV_CHANGED;
    }
-   sendDeviceList();
+}
+
+/*
+ * Link counters a newer client appends to its beacon reply:
+ *   10: NRF_TELEMETRY_V1  11-14: broadcast packets received
+ *   15-16: latches missed  17-18: latched frames short  19-20: CRC errors
+ * Loss is what it received against what we sent for its universe since
+ * its last reply. A client counts every broadcast packet carrying its
+ * universe: blocks, compressed runs, parity and latches. A client that
+ * restarted, or a restart here, shows as more received than sent and
+ * just starts the count again.
+ */
+void WnrfDriver::parseTelemetry(tDeviceEntry *dev, const uint8_t *data) {
+   // Devices answering the beacon are on universe 0's channel, on a
+   // shared channel the start address says which universe they take
+   uint8_t  universe = gshared_chan ? dev->info.start >> 9 : 0;
+   if (universe >= gnum_universes) universe = 0;
+
+   uint32_t rx = data[11] | data[12]<<8 | data[13]<<16 | (uint32_t) data[14]<<24;
+   uint32_t tx = _universe[universe].packets;
+   uint32_t sent = tx - dev->tx_packets;
+   uint32_t got  = rx - dev->rx_packets;
+   bool first = (dev->tx_packets == 0) && (dev->rx_packets == 0);
+
+   dev->rx_packets    = rx;
+   dev->tx_packets    = tx;
+   dev->frames_missed = data[15] | data[16]<<8;
+   dev->frames_short  = data[17] | data[18]<<8;
+   dev->crc_errors    = data[19] | data[20]<<8;
+   if (first || !sent || (got > sent + sent/8 + 32)) return;
+
+   uint8_t loss = (got >= sent) ? 0 : 100 - (got*100)/sent;
+   if ((dev->loss == NRF_LOSS_UNKNOWN) || (loss/10 != dev->loss/10)) {
+      if (!dev->event) dev->event = NRF_DEV_CHANGED;
+   }
+   dev->loss = loss;
+   dev->loss_hist[dev->loss_next] = loss;
+   if (++dev->loss_next >= NRF_LOSS_HISTORY) dev->loss_next = 0;
+}
+
+/* Bootloader version from the last beacon reply, 0 if not seen */
+uint8_t WnrfDriver::deviceBlv(tDevId devId) {
+   const tDeviceEntry *dev = getDevice(devId);
+   return dev ? dev->info.blv : 0;
 }
 
 void WnrfDriver::sendBeacon() {
@@ -392,14 +1410,13 @@ void WnrfDriver::sendBeacon() {
    if (gbeacon_active == true) {
       // Throttle to every 2 seconds
       if (millis()-gbeacon_timeout > 5000) {
-         radio.stopListening();
-         radio.openWritingPipe(addr_wnrf_ctrl);
+         p2pBegin(addr_wnrf_ctrl, false);
          tempPacket[0]=0x85;
-         radio.write(tempPacket,32,1); // BROADCAST packet
+         txWrite(tempPacket, true); // BROADCAST packet
+         gbeacon_count++;
 
          gbeacon_timeout = millis();
-         radio.openWritingPipe(addr_wnrf_bcast);
-         radio.startListening();
+         p2pEnd();
       }
    }
 }
@@ -407,14 +1424,13 @@ void WnrfDriver::sendBeacon() {
 void WnrfDriver:: rx_ackaudit(uint8_t pipe, char result) {
      tPipeInfo * pid = &gPipes[pipe];
  Serial.println("Rx audit ACK");
-     pid->state = NRF_CTL_NONE;
      if (nrf_async_otaflash) {
         nrf_async_otaflash(pid->txaddr,pid->context, result);
      }
 
      // Send a reboot request to the client device
      tx_reset(pipe);
-     pid->context = NULL;
+     endSession(pipe);
 
 }
 
@@ -422,7 +1438,7 @@ void WnrfDriver:: rx_ackcommit(uint8_t pipe) {
    tPipeInfo * pid = &gPipes[pipe];
 
    if (ota_files[pipe]) {
-      if (ota_files[pipe].available()) {
+      if (pid->fw.record < pid->fw.records) {
          tx_setup(pipe,false); // Continue
       } else {
          // When End of File close the connection
@@ -456,8 +1472,14 @@ void WnrfDriver:: rx_acksetup(uint8_t pipe) {
      pid->waitCount = 0;
 }
 
-void  WnrfDriver::rx_ackbind(uint8_t pipe) {
+/*
+ * BIND ACK: 0x87,<Status>,<Blv>. Bootloaders from NRF_OTA_BLV_WINDOW on
+ * report their version here, older ones leave it 0 and the beacon reply
+ * in the registry is the only source.
+ */
+void  WnrfDriver::rx_ackbind(uint8_t pipe, uint8_t *payload) {
     tPipeInfo * pid = &gPipes[pipe];
+    uint8_t blv = payload[2] ? payload[2] : deviceBlv(pid->txaddr);
 
     Serial.print("BIND ACK success :");
     Serial.println(pipe);
@@ -466,9 +1488,22 @@ void  WnrfDriver::rx_ackbind(uint8_t pipe) {
     switch(pid->bind_reason) {
        case BIND_FLASH:
           if (ota_files[pipe]) {
-             tx_setup(pipe,false);
+             // Newer bootloaders take a window of records per ACK
+             if ((blv >= NRF_OTA_BLV_WINDOW) &&
+                 (pid->win = static_cast<tOtaWindow *>(malloc(sizeof(tOtaWindow))))) {
+                Serial.println("Windowed OTA");
+                pid->win->base = 0;
+                pid->win->next = 0;
+                pid->win->eof  = false;
+                pid->state = NRF_CTL_W4_WINDOW_ACK;
+                tx_window(pipe);
+             } else {
+                if (!blv) Serial.println("Bootloader version unknown, record at a time OTA");
+                tx_setup(pipe,false);
+             }
           } else {
-             pid->state = NRF_CTL_NONE;
+             endSession(pipe);
+             return;
           }
           // Hand control to the FILE parsing engine
           break;
@@ -513,14 +1548,11 @@ bool WnrfDriver::tx_audit(uint8_t pipe) {
   tPipeInfo *pid = &(gPipes[pipe]);
 
   char msg[32];
+  char str[48];
   bool retCode = false;
-  uint8_t size = 0;
-  uint16_t addr;
 
-
-  // Hack.. use the msg buffer initially as a string
-   sprintf(msg,"Tx audit ADDR:%4.4x  Size:%4.4X CSUM:%4.4X",pid->fw.start, pid->fw.size, pid->fw.csum);
-   Serial.println(msg);
+   sprintf(str,"Tx audit ADDR:%4.4x  Size:%4.4X CSUM:%4.4X",pid->fw.start, pid->fw.size, pid->fw.csum);
+   Serial.println(str);
 
    msg[0] = 0x83; // AUDIT
    msg[1] = pid->fw.start&0xff;
@@ -531,14 +1563,11 @@ bool WnrfDriver::tx_audit(uint8_t pipe) {
    msg[6] = pid->fw.csum>>8&0xff;
    msg[7] = 0x01;
 
-   radio.stopListening(); // Ready to Write - EN_RXADDRP0 = 1
-   radio.openWritingPipe(pid->txaddr);
-   radio.setAutoAck(0,true);
+   p2pBegin(pid->txaddr, true); // Ready to Write - EN_RXADDRP0 = 1
 
-   retCode =  radio.write(msg,32); // Want to get AA working here
+   retCode =  txWrite(msg, false, pipe); // Want to get AA working here
 
-   radio.setAutoAck(0,false);  // Allow Broadcasting
-   radio.startListening();     // EN_RXADDRP0 = 0
+   p2pEnd();
 
    Serial.println("Tx Audit Completed");
   return retCode;
@@ -549,36 +1578,21 @@ bool WnrfDriver::tx_commit(uint8_t pipe) {
 
   char msg[32];
   bool retCode = false;
-  uint8_t size = 0;
-  uint16_t addr;
-  int csum = 0;
 
-   memset(msg, 0xff, sizeof(msg));
    if (ota_files[pipe]) {
-      File *file = &(ota_files[pipe]);
-
-      size = lhe_read_record_at(&(ota_files[pipe]),pid->fw.offset,&addr,&(msg[0]));
-
-      for (int i=0;i<sizeof(msg);i++){
-         csum-=msg[i];
-      }
-
-      csum &= 0xFF;
+      memcpy(msg, pid->fw.data, sizeof(msg));
 
       msg[0] = 0x82; // COMMIT
       msg[1] = 0x01;
-      msg[2] = (csum&0xFF);
-      msg[3] = msg[30]; // Last Word
-      msg[4] = msg[31];
+      msg[2] = pid->fw.rcsum;
+      msg[3] = pid->fw.data[30]; // Last Word
+      msg[4] = pid->fw.data[31];
 
-      radio.stopListening(); // Ready to Write - EN_RXADDRP0 = 1
-      radio.openWritingPipe(pid->txaddr);
-      radio.setAutoAck(0,true);
+      p2pBegin(pid->txaddr, true); // Ready to Write - EN_RXADDRP0 = 1
 
-      retCode =  radio.write(msg,32); // Want to get AA working here
+      retCode =  txWrite(msg, false, pipe); // Want to get AA working here
 
-      radio.setAutoAck(0,false);  // Allow Broadcasting
-      radio.startListening();     // EN_RXADDRP0 = 0
+      p2pEnd();
    } else {
       Serial.println("tx_commit - invalid file handle");
    }
@@ -591,31 +1605,19 @@ bool WnrfDriver::tx_write(uint8_t pipe) {
 
   char msg[34];  // Note - oversized
   bool retCode = false;
-  uint8_t size = 0;
-  uint16_t addr;
-
-  // Restructure so we only read once .. vs 3 times
-  //  Read Header..
-  //  Read Payload (store word (or 2))
-  //  Commit + Word
-  memset(msg,0xff,sizeof(msg));
 
    if (ota_files[pipe]) {
-
-      size = lhe_read_record_at(&(ota_files[pipe]),pid->fw.offset,&addr,&(msg[1]));
       // *NOTE* - offset 1 so that we have room for the command
+      memcpy(&(msg[1]), pid->fw.data, sizeof(pid->fw.data));
 
       msg[0] = 0x81;
       pid->state = NRF_CTL_W4_WRITE_ACK;
 
-      radio.stopListening(); // Ready to Write - EN_RXADDRP0 = 1
-      radio.openWritingPipe(pid->txaddr);
-      radio.setAutoAck(0,true);
+      p2pBegin(pid->txaddr, true); // Ready to Write - EN_RXADDRP0 = 1
 
-      retCode =  radio.write(msg,32); // Want to get AA working here
+      retCode =  txWrite(msg, false, pipe); // Want to get AA working here
 
-      radio.setAutoAck(0,false);  // Allow Broadcasting
-      radio.startListening();     // EN_RXADDRP0 = 0
+      p2pEnd();
    } else {
       Serial.println("tx_write - invalid file handle");
    }
@@ -623,66 +1625,198 @@ bool WnrfDriver::tx_write(uint8_t pipe) {
 
 }
 
+/* Next record of the OTA image into the pipe's cache, false at the end */
+bool WnrfDriver::loadRecord(uint8_t pipe) {
+   tPipeInfo *pid = &(gPipes[pipe]);
+   tImageRecord rec;
+
+   if (pid->fw.record >= pid->fw.records) return false;
+   if (!lhe_read_image_record(&(ota_files[pipe]), pid->fw.record, &rec)) {
+      Serial.println("OTA image read error");
+      return false;
+   }
+   pid->fw.record++;
+   pid->fw.addr  = rec.addr;
+   pid->fw.rcsum = rec.csum;
+   memcpy(pid->fw.data, rec.data, sizeof(pid->fw.data));
+   return true;
+}
+
 bool WnrfDriver::tx_setup(uint8_t pipe, bool resend) {
   tPipeInfo *pid = &(gPipes[pipe]);
 
   char msg[32];
   bool retCode = false;
-  uint8_t size = 0;
-  uint16_t addr;
-
-   // Ugly - can we optimize to avoid needing to wipe this every loop
-   memset(msg,0xff,sizeof(msg));
 
    if (ota_files[pipe]) {
-      if (resend) {
-         size = lhe_read_record_at(&(ota_files[pipe]),pid->fw.offset,&addr,&(msg[0]));
-      } else {
-         pid->fw.offset = ota_files[pipe].position(); // Ensure I can come back here
-
-         size = lhe_read_record(&(ota_files[pipe]),&addr,&(msg[0]));
-         if (size>0) { // There is data to send
-
-            pid->fw.size+= size;
-
-            if (pid->fw.start == 0) {
-               pid->fw.start = addr;
-            }
-
-            // Ugly.. WORD checksum
-            for (int i=0;i<size;i+=2){
-               pid->fw.csum-=(msg[i+1]<<8|msg[i]);
-            }
-         } else {
-            // No additional data..
-            // Jump to Audit
-            ota_files[pipe].close();
-            pid->state = NRF_CTL_W4_AUDIT_ACK;
-            tx_audit(pipe);
-            return retCode;
-         }
+      // The record stays cached for the WRITE, COMMIT and any resend
+      if (!resend && !loadRecord(pipe)) {
+         // No additional data..
+         // Jump to Audit
+         ota_files[pipe].close();
+         pid->state = NRF_CTL_W4_AUDIT_ACK;
+         tx_audit(pipe);
+         return retCode;
       }
       pid->state = NRF_CTL_W4_SETUP_ACK;
 
+      memcpy(msg, pid->fw.data, sizeof(msg));
       msg[0] = 0x80; // flash write SETUP
-      msg[1] = addr&0xff;
-      msg[2] = addr>>8&0xff;
+      msg[1] = pid->fw.addr&0xff;
+      msg[2] = pid->fw.addr>>8&0xff;
       msg[3] = 0x01; // Erase Flash
 
-      radio.stopListening(); // Ready to Write - EN_RXADDRP0 = 1
-      radio.openWritingPipe(pid->txaddr);
-      radio.setAutoAck(0,true);
+      p2pBegin(pid->txaddr, true); // Ready to Write - EN_RXADDRP0 = 1
 
-      retCode =  radio.write(msg,32); // Want to get AA working here
+      retCode =  txWrite(msg, false, pipe); // Want to get AA working here
 
-      radio.setAutoAck(0,false);  // Allow Broadcasting
-      radio.startListening();     // EN_RXADDRP0 = 0
+      p2pEnd();
    } else {
       Serial.println("tx_setup - invalid file handle");
    }
    return retCode;
 }
 
+/*
+ * Windowed OTA (bootloader NRF_OTA_BLV_WINDOW and later). Each HEX record
+ * goes out as two packets, the first erases the row and latches the first
+ * half, the second latches the rest and writes the row:
+ *    0x89,<Seq>,<AddrL>,<AddrH>,<Flags>,<Csum>,<Data x16>
+ * Up to NRF_OTA_WINDOW packets are in flight. The client acknowledges each
+ * row written (or a gap it has seen) with
+ *    0x89,<Status>,<NextSeq>,<Map0>,<Map1>,<Map2>,<Map3>
+ * where Map bit n means packet NextSeq+1+n is held, so only the holes
+ * below the highest packet received are sent again.
+ * One record goes out per call, serviceSessions() fills the rest of the
+ * window a record at a time, taking turns with the other sessions.
+ */
+bool WnrfDriver::tx_window(uint8_t pipe) {
+  tPipeInfo  *pid = &(gPipes[pipe]);
+  tOtaWindow *win = pid->win;
+  bool retCode = true;
+
+   if (!win || !ota_files[pipe]) {
+      Serial.println("tx_window - invalid file handle");
+      return false;
+   }
+
+   // Room for both halves of another record?
+   if (windowRoom(win)) {
+      if (loadRecord(pipe)) {
+         p2pBegin(pid->txaddr, true); // Ready to Write - EN_RXADDRP0 = 1
+
+         for (uint8_t half=0; half<2; half++) {
+            uint8_t *pkt = win->pkt[win->next % NRF_OTA_WINDOW];
+            uint16_t hAddr = pid->fw.addr + half*8; // 8 words per half
+            uint8_t  csum = 0;
+
+            memset(pkt, 0x00, 32);
+            pkt[0] = 0x89;
+            pkt[1] = win->next;
+            pkt[2] = hAddr&0xff;
+            pkt[3] = hAddr>>8&0xff;
+            pkt[4] = half ? OTA_FLAG_PROGRAM : OTA_FLAG_ERASE;
+            memcpy(&(pkt[6]), &(pid->fw.data[half*16]), 16);
+            for (int i=0;i<16;i++) {
+               csum -= pkt[6+i];
+            }
+            pkt[5] = csum;
+
+            retCode &= txWrite(pkt, false, pipe);
+            win->next++;
+         }
+
+         p2pEnd();
+      } else {
+         win->eof = true;
+      }
+   }
+
+   if (win->eof && (win->base == win->next)) {
+      // Every record is in flash
+      closeWindow(pipe);
+      pid->state = NRF_CTL_W4_AUDIT_ACK;
+      tx_audit(pipe);
+   }
+   return retCode;
+}
+
+/* Resend the holes in the map, or (all) everything not yet acknowledged */
+void WnrfDriver::tx_windowresend(uint8_t pipe, uint32_t map, bool all) {
+  tPipeInfo  *pid = &(gPipes[pipe]);
+  tOtaWindow *win = pid->win;
+
+   if (!win || (win->base == win->next)) return;
+
+   p2pBegin(pid->txaddr, true); // Ready to Write - EN_RXADDRP0 = 1
+
+   for (uint8_t seq = win->base; seq != win->next; seq++) {
+      uint8_t n = seq - win->base;
+      if (n) {
+         if (map & (1UL<<(n-1))) continue;            // Client has it
+         if (!all && !(map >> (n-1))) break;          // Still on its way
+      }
+      txWrite(win->pkt[seq % NRF_OTA_WINDOW], false, pipe);
+      gstats.retries++;
+   }
+
+   p2pEnd();
+}
+
+/*
+ * Give the windowed OTA sessions a turn each, one record per call, so
+ * several devices flash side by side and none of them hogs the air while
+ * the others' ACKs wait.
+ */
+void WnrfDriver::serviceSessions(void) {
+   for (uint8_t n=0; n<MAX_P2P_PIPES; n++) {
+      uint8_t pipe = gsession_next;
+      tPipeInfo *pid = &gPipes[pipe];
+
+      gsession_next = (gsession_next+1) % MAX_P2P_PIPES;
+      if ((pid->state == NRF_CTL_W4_WINDOW_ACK) && windowRoom(pid->win)) {
+         tx_window(pipe);
+         return;
+      }
+   }
+}
+
+void WnrfDriver::closeWindow(uint8_t pipe) {
+   if (ota_files[pipe]) ota_files[pipe].close();
+   if (gPipes[pipe].win) {
+      free(gPipes[pipe].win);
+      gPipes[pipe].win = NULL;
+   }
+}
+
+void WnrfDriver::rx_ackwindow(uint8_t pipe, uint8_t *payload) {
+   tPipeInfo  *pid = &gPipes[pipe];
+   tOtaWindow *win = pid->win;
+   uint8_t  ack = payload[2];
+   uint32_t map = payload[3] | payload[4]<<8 | payload[5]<<16 | (uint32_t) payload[6]<<24;
+
+   if (!win) return;
+   if (payload[1] != 0x01) {
+      Serial.println("Window write failed");
+   }
+
+   // Cumulative - everything ahead of 'ack' has been written
+   if ((uint8_t)(ack - win->base) <= (uint8_t)(win->next - win->base)) {
+      if (ack != win->base) {
+         // Progress, restart the timeout for ACK failure
+         pid->waitTime = millis();
+         pid->waitCount = 0;
+      }
+      win->base = ack;
+   }
+
+   // Selective - the client holds later packets, fill the holes
+   if (map) {
+      tx_windowresend(pipe, map, false);
+   }
+   tx_window(pipe);
+}
+
 bool WnrfDriver::tx_bind(uint8_t pipe) {
    uint8_t msg[32];
    bool retCode = false;
@@ -704,22 +1838,18 @@ bool WnrfDriver::tx_bind(uint8_t pipe) {
    }
    Serial.println(".");
 
-      radio.openReadingPipe(pipe+2,gPipes[pipe].rxaddr);
-      radio.setAutoAck(pipe+2,true);
+      // The reply pipe (pipe+2) has been open since begin()
 
       msg[16]=millis()&0xff; // prevent issues of same payload being ignored
 
-      radio.stopListening();   // Ready to write EN_RXADDR_P0 = 1
-      // Using the broadcast
-      radio.setAutoAck(0,false);// BIND is sent as a broadcast first ...
-
-      radio.openWritingPipe(gPipes[pipe].txaddr); // Who I'm sending it to
+      // BIND is sent as a broadcast first ... to who I'm sending it to
+      p2pBegin(gPipes[pipe].txaddr, false);
 
       gPipes[pipe].waitTime=millis();
 
-      retCode = radio.write(msg,32); // Want to get AA working here
+      retCode = txWrite(msg, false, pipe); // Want to get AA working here
 
-      radio.startListening(); // EN_RXADDR_P0 = 0
+      p2pEnd();
 
 
    return retCode;
@@ -727,7 +1857,10 @@ bool WnrfDriver::tx_bind(uint8_t pipe) {
 
 
 int WnrfDriver::nrf_bind(tDevId devId, uint8_t reason, void * context) {
-   // Scan pipe list to see if a pipe is available
+   // One session per device, then scan pipe list to see if a pipe is available
+   if (deviceBusy(devId)) {
+      return -1;
+   }
    int pipe = storeContext(context);
 
    if (pipe == -1) {
@@ -735,11 +1868,10 @@ int WnrfDriver::nrf_bind(tDevId devId, uint8_t reason, void * context) {
       return -1;
    }
 
-   gbeacon_active = false; // Timeout handler can re-enable
-
    gPipes[pipe].state = NRF_CTL_W4_BIND_ACK;
    gPipes[pipe].txaddr = devId;
    gPipes[pipe].bind_reason = reason;
+   updateBeacon(); // Off once every pipe is in use
 
    // Send the NRF BIND request
    tx_bind(pipe);
@@ -762,15 +1894,12 @@ bool WnrfDriver::sendGenericCmd(uint8_t pipe, uint8_t cmd, uint16_t value) {
    Serial.print(pipe);
    Serial.println(")");
 
-   radio.stopListening();
-   radio.openWritingPipe(pid->txaddr);
-   radio.setAutoAck(0,true);// P2P uses AA on the receiver
+   p2pBegin(pid->txaddr, true); // Ready to Write - EN_RXADDRP0 = 1
    tempPacket[0] = cmd;
    tempPacket[1] = value&0xFF;
    tempPacket[2] = value>>8;
-   retCode = radio.write(tempPacket,32);
-   radio.setAutoAck(0,false);
-   radio.startListening();
+   retCode = txWrite(tempPacket, false, pipe);
+   p2pEnd();
    return retCode;
 }
 
@@ -829,8 +1958,8 @@ int WnrfDriver::nrf_rfchan_update(tDevId devId, uint8_t chanId, void * context)
 
 int WnrfDriver::nrf_startaddr_update(tDevId devId, uint16_t start, void * context) {
   int retCode = -1;
-  // Check we can access the file?
-  if (start<=512){
+  // A shared channel client may start in any universe
+  if (start<=(gshared_chan ? gnum_channels : 512)){
       // Send the BIND and enter wait for BIND timeout
       int pipe = nrf_bind(devId, BIND_START, context);
       if (pipe>=0) {
@@ -848,45 +1977,408 @@ int WnrfDriver::nrf_startaddr_update(tDevId devId, uint16_t start, void * contex
 }
 
 
-int WnrfDriver::nrf_flash(tDevId devId, char *fname, void * context) {
+/* fname is a binary OTA image (see HexParser.h), not the uploaded HEX */
+int WnrfDriver::nrf_flash(tDevId devId, const char *fname, void * context) {
    int retCode = -15;
    // Check we can access the file?
    if (fname) {
+      tImageHeader hdr;
+
       // Attempt to open the file
       Serial.print("Opening ");
       Serial.println(fname);
 
+      File image = SPIFFS.open(fname,"r");
+      if (!image) {
+         Serial.println("Failed to open the OTA image");
+         return retCode;
+      }
+      if (!lhe_read_image_header(&image, &hdr)) {
+         Serial.println("Invalid OTA image");
+         image.close();
+         return -16;
+      }
+
       // Send the BIND and enter wait for BIND timeout
       int pipe = nrf_bind(devId, BIND_FLASH, context);
       if (pipe>=0) {
-         ota_files[pipe]= SPIFFS.open(fname,"r");
-         gPipes[pipe].fw.offset = 0; // Start of File
-         gPipes[pipe].fw.start = 0;
-         gPipes[pipe].fw.size = 0;
-         gPipes[pipe].fw.csum = 0;
-
-         if (ota_files[pipe]) {
-            retCode = 0;
+         ota_files[pipe] = image;
+         gPipes[pipe].fw.record  = 0; // Start of the image
+         gPipes[pipe].fw.records = hdr.records;
+         gPipes[pipe].fw.start   = hdr.start;
+         gPipes[pipe].fw.size    = hdr.size;
+         gPipes[pipe].fw.csum    = hdr.csum;
+         retCode = 0;
+      } else {
+         image.close();
+      }
+   }
+   return retCode;
+}
+
+/*
+ * Broadcast OTA (bootloader NRF_OTA_BLV_FLEET and later). The image goes
+ * out once on the fleet address to every device of a type/apm, then only
+ * the records someone missed are sent again:
+ *    JOIN  0x8A,0x01,<Id:3>,<RecordsL>,<RecordsH>                      (P2P)
+ *          The device clears its record map and listens on the fleet address
+ *    DATA  0x8A,0x02,<RecL>,<RecH>,<AddrL>,<AddrH>,<Flags>,<Csum>,<Data x16>
+ *          Two per record, as for the windowed OTA, on the fleet address (or
+ *          P2P for a repair). The row is written once both halves are in.
+ *    POLL  0x8A,0x03,<Id:3>,<FromL>,<FromH>                            (P2P)
+ *          0x8A,0x03,<Id:3>,<FromL>,<FromH>,<MissingL>,<MissingH>,<Map x23>
+ *          back on the control address, Map bit n = record From+n missing.
+ *    AUDIT 0x8A,0x04,<Id:3>,<StartL>,<StartH>,<WordsL>,<WordsH>,<CsumL>,<CsumH>
+ *          0x8A,0x04,<Id:3>,<Result> back, the device reboots when good.
+ * A record NACKed by one device is repaired P2P (auto-ack does the retries),
+ * by several it is broadcast again. Then the devices are polled again, for
+ * up to NRF_FLEET_ROUNDS rounds.
+ * Returns the number of devices taking part, <0 on error.
+ */
+int WnrfDriver::nrf_fleetflash(uint8_t type, uint8_t apm, const char *fname, void * context) {
+   tImageHeader hdr;
+   tFleetSession *fs;
+
+   if (gfleet) return -17; // One broadcast at a time
+   if (!fname) return -15;
+
+   File image = SPIFFS.open(fname,"r");
+   if (!image) {
+      Serial.println("Failed to open the OTA image");
+      return -15;
+   }
+   if (!lhe_read_image_header(&image, &hdr)) {
+      Serial.println("Invalid OTA image");
+      image.close();
+      return -16;
+   }
+   if (hdr.records > NRF_FLEET_RECORDS) {
+      image.close();
+      return -19;
+   }
+   fs = static_cast<tFleetSession *>(calloc(1, sizeof(tFleetSession)));
+   if (!fs) {
+      image.close();
+      return -20;
+   }
+
+   // Everybody seen with this firmware and a bootloader that can take it
+   for (int i=0; (i<gdevice_count) && (fs->count<NRF_FLEET_MAX); i++) {
+      tDeviceInfo *dev = &gdevices[i].info;
+      if ((dev->type == type) && (dev->apm == apm) &&
+          (dev->blv >= NRF_OTA_BLV_FLEET) && !deviceBusy(dev->dev_id)) {
+         fs->dev[fs->count++].dev_id = dev->dev_id;
+      }
+   }
+   if (!fs->count) {
+      free(fs);
+      image.close();
+      return -18;
+   }
+
+   fs->phase   = FLEET_JOIN;
+   fs->records = hdr.records;
+   fs->start   = hdr.start;
+   fs->size    = hdr.size;
+   fs->csum    = hdr.csum;
+   fs->context = context;
+   fleet_file  = image;
+   gfleet = fs;
+
+   Serial.print("Broadcast OTA to ");
+   Serial.print(fs->count);
+   Serial.println(" devices");
+   return fs->count;
+}
+
+/* Devices of the broadcast OTA in this state */
+static uint8_t fleetCount(const tFleetSession *fs, uint8_t state) {
+   uint8_t count = 0;
+   for (int i=0; i<fs->count; i++) {
+      if (fs->dev[i].state == state) count++;
+   }
+   return count;
+}
+
+/* One step of the broadcast OTA per call, admin traffic takes turns */
+void WnrfDriver::serviceFleet(void) {
+   tFleetSession *fs = gfleet;
+
+   if (!fs) return;
+   if (fs->waiting) {
+      if (millis() - fs->asked >= NRF_FLEET_REPLY_MS) {
+         fs->waiting = false; // No reply, ask again
+         gstats.retries++;
+         fleetMissed();
+      }
+      return;
+   }
+
+   switch (fs->phase) {
+      case FLEET_JOIN:
+         if (fs->current < fs->count) {
+            if (fleetRequest(fs->current, FLEET_OP_JOIN)) {
+               fs->dev[fs->current].state = FLEET_DEV_ACTIVE;
+               fs->dev[fs->current].tries = 0;
+               fs->current++;
+            } else {
+               fleetMissed();
+            }
+         } else if (fleetCount(fs, FLEET_DEV_ACTIVE)) {
+            Serial.println("Broadcast OTA streaming");
+            fs->phase = FLEET_STREAM;
+            fs->record = 0;
+         } else {
+            fleetEnd();
+         }
+         break;
+
+      case FLEET_STREAM:
+         if (micros() - fs->sent < NRF_FLEET_RECORD_US) break;
+         if (fs->record < fs->records) {
+            fleetRecord(fs->record++, addr_wnrf_fleet, false);
+         } else {
+            fs->phase = FLEET_POLL;
+            fs->current = 0;
+            fs->record = 0;
+         }
+         break;
+
+      case FLEET_POLL:
+         while ((fs->current < fs->count) && (fs->dev[fs->current].state != FLEET_DEV_ACTIVE)) {
+            fs->current++;
+         }
+         if (fs->current < fs->count) {
+            if (!fleetRequest(fs->current, FLEET_OP_POLL)) fleetMissed();
+            break;
+         }
+
+         // Round over, repair what was missed or on to the AUDIT
+         fs->current = 0;
+         fs->record = 0;
+         if (fleetCount(fs, FLEET_DEV_ACTIVE) && (++fs->round < NRF_FLEET_ROUNDS)) {
+            fs->phase = FLEET_REPAIR;
+         } else {
+            for (int i=0; i<fs->count; i++) {
+               if (fs->dev[i].state == FLEET_DEV_ACTIVE) fleetResult(i, -1);
+            }
+            fs->phase = FLEET_AUDIT;
+         }
+         break;
+
+      case FLEET_REPAIR:
+         if (micros() - fs->sent < NRF_FLEET_RECORD_US) break;
+         while ((fs->record < fs->records) && !fs->nack[fs->record]) {
+            fs->record++;
+         }
+         if (fs->record < fs->records) {
+            uint8_t who = fs->nack[fs->record];
+            gstats.retries += 2;
+            if (who == FLEET_NACK_MANY) {
+               fleetRecord(fs->record, addr_wnrf_fleet, false);
+            } else {
+               tFleetDevice *dev = &fs->dev[who-1];
+               if (!fleetRecord(fs->record, dev->dev_id, true) && (++dev->tries < NRF_FLEET_TRIES)) {
+                  break; // Not acknowledged, straight back to it
+               }
+               dev->tries = 0; // The next POLL decides
+            }
+            fs->nack[fs->record++] = 0;
+         } else {
+            fs->phase = FLEET_POLL;
+            fs->record = 0;
+         }
+         break;
+
+      case FLEET_AUDIT:
+         while ((fs->current < fs->count) && (fs->dev[fs->current].state != FLEET_DEV_READY)) {
+            fs->current++;
+         }
+         if (fs->current < fs->count) {
+            if (!fleetRequest(fs->current, FLEET_OP_AUDIT)) fleetMissed();
          } else {
-            Serial.println("Failed to save context");
+            Serial.println("Broadcast OTA complete");
+            fleetEnd();
          }
+         break;
+   }
+}
+
+/* JOIN, POLL or AUDIT to one device, a POLL/AUDIT then waits for the reply */
+bool WnrfDriver::fleetRequest(uint8_t index, uint8_t op) {
+   tFleetSession *fs = gfleet;
+   tDevId devId = fs->dev[index].dev_id;
+   uint8_t msg[32];
+   bool retCode;
+
+   memset(msg, 0x00, sizeof(msg));
+   msg[0] = 0x8A;
+   msg[1] = op;
+   memcpy(&(msg[2]), &devId, 3);
+   switch (op) {
+      case FLEET_OP_JOIN:
+         msg[5] = fs->records&0xff;
+         msg[6] = fs->records>>8&0xff;
+         break;
+      case FLEET_OP_POLL:
+         msg[5] = fs->record&0xff;
+         msg[6] = fs->record>>8&0xff;
+         break;
+      case FLEET_OP_AUDIT: // As tx_audit()
+         msg[5] = fs->start&0xff;
+         msg[6] = fs->start>>8&0xff;
+         msg[7] = fs->size>>1&0xff; // Note: /2 as it's number of WORDS
+         msg[8] = fs->size>>9&0xff;
+         msg[9] = fs->csum&0xff;
+         msg[10] = fs->csum>>8&0xff;
+         break;
+   }
+
+   p2pBegin(devId, true);
+   retCode = txWrite(msg, false);
+   p2pEnd();
+
+   if (retCode && (op != FLEET_OP_JOIN)) {
+      fs->waiting = true;
+      fs->asked = millis();
+   }
+   return retCode;
+}
+
+/* Both halves of a record, broadcast or (p2p) to a single device */
+bool WnrfDriver::fleetRecord(uint16_t record, tDevId addr, bool p2p) {
+   tImageRecord rec;
+   uint8_t pkt[32];
+   bool retCode = true;
+
+   gfleet->sent = micros();
+   if (!lhe_read_image_record(&fleet_file, record, &rec)) {
+      Serial.println("OTA image read error");
+      return false;
+   }
+
+   p2pBegin(addr, p2p);
+   for (uint8_t half=0; half<2; half++) {
+      uint16_t hAddr = rec.addr + half*8; // 8 words per half
+      uint8_t  csum = 0;
+
+      memset(pkt, 0x00, sizeof(pkt));
+      pkt[0] = 0x8A;
+      pkt[1] = FLEET_OP_DATA;
+      pkt[2] = record&0xff;
+      pkt[3] = record>>8&0xff;
+      pkt[4] = hAddr&0xff;
+      pkt[5] = hAddr>>8&0xff;
+      pkt[6] = half ? OTA_FLAG_PROGRAM : OTA_FLAG_ERASE;
+      memcpy(&(pkt[8]), &(rec.data[half*16]), 16);
+      for (int i=0;i<16;i++) {
+         csum -= pkt[8+i];
       }
+      pkt[7] = csum;
+
+      retCode &= txWrite(pkt, !p2p);
    }
+   p2pEnd();
    return retCode;
 }
 
+/* The current device did not answer, drop it after NRF_FLEET_TRIES */
+void WnrfDriver::fleetMissed(void) {
+   tFleetSession *fs = gfleet;
+
+   if (++fs->dev[fs->current].tries >= NRF_FLEET_TRIES) {
+      gstats.timeouts++;
+      fleetResult(fs->current, -1);
+      fs->current++;
+      fs->record = 0;
+   }
+}
+
+void WnrfDriver::fleetResult(uint8_t index, int result) {
+   tFleetDevice *dev = &gfleet->dev[index];
+   char tempid[8];
+
+   id2txt(tempid, dev->dev_id);
+   Serial.print("Broadcast OTA ");
+   Serial.print(tempid);
+   Serial.print(" result ");
+   Serial.println(result);
+
+   dev->state = FLEET_DEV_DONE;
+   if (nrf_async_otaflash) {
+      nrf_async_otaflash(dev->dev_id, gfleet->context, result);
+   }
+}
+
+void WnrfDriver::fleetEnd(void) {
+   if (fleet_file) fleet_file.close();
+   free(gfleet);
+   gfleet = NULL;
+}
+
+/* POLL or AUDIT reply on the control address */
+void WnrfDriver::rx_fleet(uint8_t *payload) {
+   tFleetSession *fs = gfleet;
+   tDevId devId = payload[4]<<16|payload[3]<<8|payload[2];
+
+   if (!fs || !fs->waiting || (fs->current >= fs->count)) return;
+   tFleetDevice *dev = &fs->dev[fs->current];
+   if (dev->dev_id != devId) return; // Late reply to an earlier request
+
+   if ((payload[1] == FLEET_OP_POLL) && (fs->phase == FLEET_POLL)) {
+      uint16_t from    = payload[5] | payload[6]<<8;
+      uint16_t missing = payload[7] | payload[8]<<8;
+
+      if (from != fs->record) return;
+      fs->waiting = false;
+      dev->tries = 0;
+      if (!missing) {
+         dev->state = FLEET_DEV_READY;
+         fs->current++;
+         fs->record = 0;
+         return;
+      }
+      for (uint16_t n=0; (n<NRF_FLEET_MAP) && (from+n < fs->records); n++) {
+         if (payload[9+(n>>3)] & (1<<(n&7))) {
+            fs->nack[from+n] = fs->nack[from+n] ? FLEET_NACK_MANY : fs->current+1;
+         }
+      }
+      fs->record += NRF_FLEET_MAP;
+      if (fs->record >= fs->records) {
+         fs->current++;
+         fs->record = 0;
+      }
+   } else if ((payload[1] == FLEET_OP_AUDIT) && (fs->phase == FLEET_AUDIT)) {
+      fs->waiting = false;
+      fleetResult(fs->current++, payload[5]);
+   }
+}
+
 
 void WnrfDriver::checkRx() {
-    /* Was there a received packet? */
-    uint8_t pipe;
-    if (radio.available(&pipe)) {
+    // Keep a universe moving even when loop() holds off show(). Nothing
+    // is received in TX mode, and admin traffic waits for the gap after it
+    if (gtx_active) {
+        txService();
+        if (gtx_active) return;
+    }
+
+    // Nothing for us on the channel being scanned
+    if (serviceScan()) return;
+
+    /* Was there a received packet? Not while parked in TX */
+    uint8_t pipe = 0xFF;
+    if (glistening && radio.available(&pipe)) {
         uint8_t payload[32];
 
         radio.read(payload,32);
+        if (pipe < 6) gstats.rx_packets[pipe]++;
 
         if (pipe == 1) { // RX on the broadcast address
            if (payload[0] ==0x88){ // Beacon response from client devices
-              parseNrf_x88(payload);
+              parseNrf_x88(payload, radio.testRPD());
+           } else if (payload[0] == 0x8A) { // Broadcast OTA reply
+              rx_fleet(payload);
            } else {
                 if (payload[0] == 0x85) { // BEACON message
                   Serial.println("** WNRF Beacon detected!!");
@@ -906,13 +2398,16 @@ void WnrfDriver::checkRx() {
           pipe -=2;  //Index into gPipes array
 
           tPipeInfo * pid = &(gPipes[pipe]);
-          boolean check_beacon = false;
+
+          if ((pid->state > NRF_CTL_NONE) && (pid->state <= NRF_ACK_STATES)) {
+             nrfHistAdd(&gstats.ack_us[pid->state-1], micros() - pid->txTime);
+          }
 
           // Deal with it
           switch (pid->state) {
              case NRF_CTL_W4_BIND_ACK:
                if (payload[0] == 0x87) {
-                 rx_ackbind(pipe);
+                 rx_ackbind(pipe, payload);
                }
                break;
              case NRF_CTL_W4_SETUP_ACK:
@@ -921,6 +2416,7 @@ void WnrfDriver::checkRx() {
                     rx_acksetup(pipe);
                  } else {
                     Serial.println("Setup failed");
+                    gstats.retries++;
                     tx_setup(pipe, true);
                  }
                }
@@ -931,6 +2427,7 @@ void WnrfDriver::checkRx() {
                    rx_ackwrite(pipe);
                  } else {
                    Serial.println("WRITE failed");
+                   gstats.retries++;
                    tx_write(pipe);
                  }
                }
@@ -941,15 +2438,20 @@ void WnrfDriver::checkRx() {
                    rx_ackcommit(pipe);
                  } else {
                    Serial.println("Commit failed");
+                   gstats.retries++;
                    tx_commit(pipe);
                  }
                }
                break;
+             case NRF_CTL_W4_WINDOW_ACK:
+               if (payload[0] == 0x89) {
+                 rx_ackwindow(pipe, payload);
+               }
+               break;
              case NRF_CTL_W4_AUDIT_ACK:
                if (payload[0] == 0x83) {
                  rx_ackaudit(pipe,(bool) payload[1]);
                }
-               check_beacon = true;
                break;
              case NRF_CTL_W4_CHAN_ACK:
                // To Do .. add some error handling here..
@@ -959,9 +2461,16 @@ void WnrfDriver::checkRx() {
                Serial.println(payload[1]);
                if (nrf_async_startaddr)
                  nrf_async_startaddr(pid->txaddr,pid->context, payload[1]);
-               pid->state = NRF_CTL_NONE;
-               pid->context = NULL;
-               check_beacon = true;
+               endSession(pipe);
+               break;
+             case NRF_CTL_W4_RF_ACK:
+               Serial.print("Receive RF_ACK : (");
+               Serial.print(pipe+2);
+               Serial.print("):");
+               Serial.println(payload[1]);
+               if (nrf_async_rfchan)
+                 nrf_async_rfchan(pid->txaddr,pid->context, payload[1]);
+               endSession(pipe);
                break;
              case NRF_CTL_NONE: // Do nothing - warn the console?
              default:
@@ -974,51 +2483,47 @@ void WnrfDriver::checkRx() {
                  Serial.print(hex);
                }
                Serial.println(".");
-               check_beacon = true;
                break;
           } // End Switch STATE
-
-          if (check_beacon) {
- 	    if (gadmin==true) { // In Admin and at least 1 pipe available
-               gbeacon_active = true;
-            }
-           }
        } // Pipe 2-5
     } // End handling of radio packet
 
     // -- Check for Timeouts
+    // Each session keeps its own timer, they run side by side
     uint32_t now = millis();
-    uint8_t  num_waiting = MAX_P2P_PIPES;
     for (int i=0;i<MAX_P2P_PIPES;i++) {
        tPipeInfo * pid = &gPipes[i];
        if (pid->state != NRF_CTL_NONE) {
-          num_waiting--;
           if (now - pid->waitTime > 1000) {
              if (pid->waitCount>10) {
                 // >10 second failure to ACK - drop the attempt
+                gstats.timeouts++;
                 switch(pid->bind_reason) {
                    case BIND_FLASH:
                       Serial.println("TIMEOUT waiting for ACK");
-                      nrf_async_otaflash(pid->txaddr,pid->context, -1);
+                      if (nrf_async_otaflash)
+                         nrf_async_otaflash(pid->txaddr,pid->context, -1);
                       break;
 
                    case BIND_DEVID:
                       Serial.println("TIMEOUT waiting for DEVICE ID ACK");
-                      nrf_async_devid(pid->txaddr,pid->context, -1);
+                      if (nrf_async_devid)
+                         nrf_async_devid(pid->txaddr,pid->context, -1);
                       break;
 
                    case BIND_START:
                       Serial.println("TIMEOUT waiting for START ADDRESS ACK");
-                      // Attempt to recover device - tell it to reset using P2P
-                      // Hail Mary as PIPE needs to match - but as we aren't using
-                      // concurrent PIPES yet.. this should work
+                      // Attempt to recover device - tell it to reset using P2P.
+                      // The pipe still holds this session's device address.
                       tx_reset(i);
-                      nrf_async_startaddr(pid->txaddr,pid->context, -1);
+                      if (nrf_async_startaddr)
+                         nrf_async_startaddr(pid->txaddr,pid->context, -1);
                       break;
 
                    case BIND_RFCHAN:
-                      Serial.println("TIMEOUT waiting for START ADDRES ACK");
-                      nrf_async_rfchan(pid->txaddr,pid->context, -1);
+                      Serial.println("TIMEOUT waiting for RF CHANNEL ACK");
+                      if (nrf_async_rfchan)
+                         nrf_async_rfchan(pid->txaddr,pid->context, -1);
                       break;
 
                    case BIND_NONE:
@@ -1026,14 +2531,13 @@ void WnrfDriver::checkRx() {
                       Serial.println("Race condition, nothing to worry about");
                       break;
                 }
-                pid->state = NRF_CTL_NONE;
-                pid->context = NULL;
- 		if (gadmin==true) { // In Admin and at least 1 pipe available
-                   gbeacon_active = true;
-                }
+                endSession(i);
              } else {
                 pid->waitTime = now;
                 pid->waitCount++;
+                if (pid->state != NRF_CTL_W4_WINDOW_ACK) {
+                   gstats.retries++; // Window resends count each packet
+                }
                 switch(pid->state) {
                    case NRF_CTL_W4_BIND_ACK:
                       Serial.println("Re-bind request");
@@ -1051,6 +2555,10 @@ void WnrfDriver::checkRx() {
                       Serial.println("Re-Commit request");
                       tx_commit(i);
                       break;
+                   case NRF_CTL_W4_WINDOW_ACK:
+                      Serial.println("Re-Send window");
+                      tx_windowresend(i, 0, true);
+                      break;
                    case NRF_CTL_W4_AUDIT_ACK:
                       Serial.println("Re-Audit request");
                       tx_audit(i);
@@ -1059,6 +2567,10 @@ void WnrfDriver::checkRx() {
                       Serial.println("Re-send set-chan request");
                       sendGenericCmd(i, 0x01 /* cmd */, pid->e131_start);
                       break;
+                   case NRF_CTL_W4_RF_ACK:
+                      Serial.println("Re-send set-rf request");
+                      sendGenericCmd(i, 0x02 /* cmd */, pid->rf_chan);
+                      break;
                    default:
                       Serial.println("Nothing Pending Timeout");
                       break;
@@ -1068,11 +2580,11 @@ void WnrfDriver::checkRx() {
        } // in W4 ack state
     } // for each pipe
 
-    // Timeout handler can re-enable
-    if (num_waiting==0) {
-       // Turn off beacon if no P2P channels available
-       gbeacon_active = false;
-    }
+    // Windowed OTA sessions take turns topping up their windows
+    serviceSessions();
+    serviceFleet();
+    serviceAutoChan();
+
     //  If in ADMIN mode - Timeouts
     sendBeacon();
     sendDeviceList();
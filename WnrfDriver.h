@@ -25,6 +25,66 @@
    // WNRF
    #define LED_NRF 15
 #endif
+// Define to the GPIO wired to the NRF24 IRQ line. When present the TX FIFO
+// is only polled after the radio signals a completed packet.
+//#define NRF_IRQ 0
+// Define to send the last, part filled, block of a universe short using the
+// NRF24 dynamic payload length. Every client must have DPL enabled too.
+//#define NRF_DYNAMIC_PAYLOAD
+
+#define NRF_TX_FIFO  (3)    // Depth of the NRF24 TX FIFO
+#define NRF_BLOCK_US (665)  // Air time budget per 32 byte block (Practical vs Theoretical 1336)
+#define NRF_KEEPALIVE_MS (100) // Default resend period for blocks that have not changed
+#define NRF_COMMIT_MS    (50)  // Swap in uncommitted changes if no end of frame arrives
+#define NRF_DMX_SHARE     (50)  // Default % of air time DMX keeps in admin mode
+#define NRF_DMX_SHARE_MIN (10)
+#define NRF_OTA_BLV_WINDOW (2)     // First bootloader version with windowed OTA (0x89)
+#define NRF_OTA_WINDOW     (8)     // OTA packets in flight, two per HEX record
+#define NRF_OTA_BLV_FLEET  (3)     // First bootloader version with broadcast OTA (0x8A)
+#define NRF_FLEET_MAX      (16)    // Devices in one broadcast OTA
+#define NRF_FLEET_RECORDS  (512)   // Largest image for a broadcast OTA (16K of PIC flash)
+#define NRF_FLEET_MAP      (184)   // Records per NACK map in a POLL reply (23 bytes)
+#define NRF_FLEET_RECORD_US (2500) // Broadcast record spacing, one client row write
+#define NRF_FLEET_REPLY_MS (100)   // Wait for a POLL/AUDIT reply before asking again
+#define NRF_FLEET_TRIES    (5)     // Unanswered requests before a device is dropped
+#define NRF_FLEET_ROUNDS   (8)     // Poll and repair rounds before giving up
+#define NRF_DEVICE_MAX     (256)   // Devices in the registry
+#define NRF_DEVICE_GROW    (32)    // Registry entries allocated at a time
+#define NRF_DEVICE_MISSED  (3)     // Beacons a device may miss before it is gone
+#define NRF_LOSS_HISTORY   (8)     // Loss figures kept per device, one per beacon reply
+#define NRF_LOSS_UNKNOWN   (0xFF)
+#define NRF_TELEMETRY_V1   (1)     // Beacon reply byte 10, link counters follow
+#define NRF_MAX_UNIVERSES  (4)     // Universes per controller, each on its own RF channel
+#define NRF_UNIVERSE_BYTES (17*32) // Radio image of one universe: 17 x (1 byte header + 31)
+#define NRF_DIV31_MUL      (2115)  // (channel*NRF_DIV31_MUL)>>16 == channel/31 for 0..511
+#define NRF_HDR_UNIVERSE   (5)     // Shared channel header: <Universe:3><Block:5>
+#define NRF_HDR_ZIP        (0x1E)  // Compressed packet: <Hdr><First block><Blocks><RLE...>
+#define NRF_HDR_LATCH      (0x1D)  // Frame latch: <Hdr><Frame><Block mask:24><Parity groups>
+#define NRF_LATCH_LEN      (6)
+#define NRF_HDR_FEC        (17)    // Parity block of group n is NRF_HDR_FEC+n
+#define NRF_FEC_MAX        (8)     // Parity groups (and packets) per cycle
+#define NRF_ZIP_MAX        (8)     // Compressed packets per cycle, each carries 2+ blocks
+#define NRF_ZIP_APV        (2)     // First client application version that decodes NRF_HDR_ZIP
+#define NRF_SCAN_CHANNELS  (84)    // Channels covered by the frequency scanner
+#define NRF_SCAN_DWELL_US  (130)   // Listen time before the carrier detect is valid
+#define NRF_SCAN_GAP_US    (1000)  // Time back home between two samples
+#define NRF_SCAN_HOLD_MS   (5000)  // Keep scanning this long after the UI last asked
+#define NRF_SCAN_DECAY     (3)     // Each sample moves a channel 1/2^n of the way
+#define NRF_AUTOCHAN_MS      (30000) // Channels are scored this often in auto mode
+#define NRF_AUTOCHAN_MARGIN  (20)    // Score a channel must beat the current one by
+#define NRF_AUTOCHAN_CONFIRM (2)     // Scorings in a row it must win before a move
+#define NRF_AUTOCHAN_WIFI    (50)    // Score for sharing spectrum with our Wi-Fi channel
+#define NRF_HIST_BUCKETS   (16)    // Log2 microsecond buckets, the last holds 16.4ms and over
+#define NRF_ACK_STATES     (9)     // Wait states (NRF_CTL_W4_xxx) with an ACK round trip
+
+// The ESP8266 has no divide instruction, setValue() finds a channel's
+// block with a multiply instead. Checked here over a whole universe.
+static constexpr bool nrfDiv31Exact(uint16_t lo, uint16_t hi) {
+    return (hi - lo <= 1) ? (((uint32_t) lo*NRF_DIV31_MUL) >> 16) == lo/31u
+                          : nrfDiv31Exact(lo, (lo+hi)/2) && nrfDiv31Exact((lo+hi)/2, hi);
+}
+static_assert(nrfDiv31Exact(0, 512), "NRF_DIV31_MUL is not exact over 512 channels");
+
 enum class NrfBaud : uint8_t {
     BAUD_1Mbps,
     BAUD_2Mbps
@@ -50,6 +110,39 @@ typedef uint32_t tDevId;
 uint32_t txt2id(const char* str);
 void id2txt(char * str, uint32_t id);
 
+/* Windowed OTA - copies of the packets in flight for selective retransmit */
+typedef struct sOtaWindow {
+  uint8_t base;     // Oldest unacknowledged sequence number
+  uint8_t next;     // Next sequence number to send
+  bool    eof;      // Last record has been read from the file
+  uint8_t pkt[NRF_OTA_WINDOW][32];
+} tOtaWindow;
+
+/* Broadcast OTA - one image streamed to many devices, see serviceFleet() */
+typedef struct sFleetDevice {
+  tDevId  dev_id;
+  uint8_t state;    // FLEET_DEV_xxx
+  uint8_t tries;    // Requests in a row without an answer
+} tFleetDevice;
+
+typedef struct sFleetSession {
+  uint8_t  phase;   // FLEET_xxx
+  uint8_t  count;   // Devices taking part
+  uint8_t  current; // Device being joined, polled or audited
+  uint8_t  round;   // Poll and repair rounds so far
+  uint16_t record;  // Next record to stream/repair, or map position polled
+  uint16_t records; // Records in the OTA image
+  uint16_t start;   // Image header, for the AUDIT
+  uint32_t size;
+  uint16_t csum;
+  bool     waiting; // POLL/AUDIT sent, reply pending
+  uint32_t sent;    // micros() the last record went out
+  uint32_t asked;   // millis() the last POLL/AUDIT went out
+  void    *context; // CallBack context to the UI session
+  tFleetDevice dev[NRF_FLEET_MAX];
+  uint8_t  nack[NRF_FLEET_RECORDS]; // 0 none, device index+1, FLEET_NACK_MANY
+} tFleetSession;
+
 typedef struct sPipeState {
   tDevId txaddr;   // Address of the target device bound to this pipe
   tDevId rxaddr;   // Pipe Address for the target device to send to
@@ -57,17 +150,25 @@ typedef struct sPipeState {
   uint8_t bind_reason;
   union {
          struct {
-            uint32_t offset;// File offset for seek/re-read attempts
+            uint16_t record; // Next record of the OTA image
+            uint16_t records;// Records in the OTA image
             uint16_t start; // Start Address in the PIC
             uint32_t size;  // Number of bytes
             uint16_t csum;  // Checksum over the entire upload space
+            uint16_t addr;  // Record on air: word address
+            uint8_t  rcsum; // Record on air: byte checksum for the COMMIT
+            uint8_t  data[32]; // Record on air: payload
          } fw;
          uint16_t e131_start;
          tDevId newId;
          uint8_t  rf_chan;
         };
+  // Windowed OTA state, NULL when flashing a record at a time
+  tOtaWindow *win;
   // CallBack context to the UI session
   void *  context;
+  // micros() of the last packet sent, for the ACK round trip
+  uint32_t txTime;
   // Timeout counter
   uint8_t  waitCount;
   uint32_t waitTime;
@@ -86,19 +187,109 @@ typedef struct sDeviceInfo {
   uint16_t start;  //E1.31 channel_start;
 } tDeviceInfo;
 
+// Automatic channel selection, see setAutoChan()
+#define NRF_AUTOCHAN_OFF     (0)
+#define NRF_AUTOCHAN_ADVISE  (1)   // Score the channels, report the best
+#define NRF_AUTOCHAN_MIGRATE (2)   // ... and move the clients and the controller to it
+
+// Compressed full mode packets, see setCompress()
+#define NRF_ZIP_OFF   (0)
+#define NRF_ZIP_AUTO  (1)   // Only while every device in the registry has apv >= NRF_ZIP_APV
+#define NRF_ZIP_ON    (2)
+
+// Registry events, pushed through nrf_async_devlist
+#define NRF_DEV_NONE    (0)
+#define NRF_DEV_NEW     (1)
+#define NRF_DEV_CHANGED (2)   // Info or link quality moved
+#define NRF_DEV_GONE    (3)   // Missed NRF_DEVICE_MISSED beacons, dropped after the push
+
+/* Registry entry, one per device heard, sorted by dev_id */
+typedef struct sDeviceEntry {
+  tDeviceInfo info;
+  uint32_t last_seen;    // millis() of the last beacon reply
+  uint16_t last_beacon;  // Beacon it last answered
+  uint16_t first_beacon; // Beacon it first answered
+  uint16_t replies;      // Beacon replies heard
+  uint16_t strong;       // Replies above the RPD threshold (-64dBm)
+  uint8_t  event;        // NRF_DEV_xxx waiting to be pushed
+  uint8_t  link;         // Reply rate (%/10) last pushed
+  // Client telemetry, from replies carrying NRF_TELEMETRY_V1
+  uint32_t rx_packets;   // Broadcast packets the client had received
+  uint32_t tx_packets;   // ... and the packets we had sent it by then
+  uint16_t frames_missed;// Latches the client missed
+  uint16_t frames_short; // Latched frames missing a block
+  uint16_t crc_errors;   // Packets the client saw fail their CRC
+  uint8_t  loss;         // % packets lost between the last two replies, or NRF_LOSS_UNKNOWN
+  uint8_t  loss_next;    // Oldest entry of loss_hist
+  uint8_t  loss_hist[NRF_LOSS_HISTORY];
+} tDeviceEntry;
+
+/* Per universe transmit state, the universe goes out on its own RF channel */
+typedef struct sNrfUniverse {
+  uint8_t  rf_chan;       // Radio channel number (not the NrfChan id)
+  uint8_t  blocks;        // Blocks holding this universe's channels (1..17)
+  uint8_t  tail_len;      // Payload bytes of the last block (header + channels)
+  uint32_t dirty;         // Blocks where the back buffer differs from the front
+  uint32_t tx_dirty;      // Blocks of the front buffer not yet queued
+  uint32_t last_sent[17]; // millis() when each block was last queued
+  uint32_t packets;       // Packets of every kind sent, free running, for the client loss
+  uint8_t  frame;         // Latches sent, numbers the next one
+} tNrfUniverse;
+
+/*
+ * Radio instrumentation. Histogram bucket n holds samples of 2^(n-1) up
+ * to 2^n - 1 us (bucket 0 is under 1us), the last bucket everything longer.
+ */
+typedef struct sNrfHist {
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint32_t bucket[NRF_HIST_BUCKETS];
+} tNrfHist;
+
+typedef struct sNrfStats {
+  uint32_t since;                      // millis() of the last reset
+  uint32_t tx_blocks;                  // DMX packets loaded into the TX FIFO
+  uint32_t tx_zipped;                  // Blocks carried by compressed packets
+  uint32_t tx_packets;                 // Blocking writes: legacy, beacon, admin and OTA
+  uint32_t tx_fail;                    // Blocking writes that were not acknowledged
+  uint32_t cycles[NRF_MAX_UNIVERSES];  // Universe cycles sent
+  uint32_t rx_packets[6];              // Packets received, per pipe
+  uint32_t retries;                    // Admin/OTA packets sent again (NAK or timeout)
+  uint32_t timeouts;                   // Admin/OTA sessions given up on
+  tNrfHist write_us;                   // Blocking radio.write(), air time and auto retries
+  tNrfHist load_us;                    // SPI time to load one DMX block into the FIFO
+  tNrfHist cycle_us;                   // Universe cycle, first block loaded to back in RX
+  tNrfHist ack_us[NRF_ACK_STATES];     // Last packet sent to its ACK, per wait state
+} tNrfStats;
+
+static inline void nrfHistAdd(tNrfHist *hist, uint32_t us) {
+  uint8_t bucket = us ? 32 - __builtin_clz(us) : 0;
+  if (bucket >= NRF_HIST_BUCKETS) bucket = NRF_HIST_BUCKETS-1;
+  hist->bucket[bucket]++;
+  hist->count++;
+  hist->total_us += us;
+  if (us > hist->max_us) hist->max_us = us;
+}
+
 typedef void (* async_bind_handler)     (tDevId devId, void * context, int result);
 typedef void (* async_flash_handler)    (tDevId devId, void * context, int result);
 typedef void (* async_rfchan_handler)   (tDevId devId, void * context, int result);
 typedef void (* async_devid_handler)    (tDevId devId, void * context, int result);
 typedef void (* async_startaddr_handler)(tDevId devId, void * context, int result);
 
-typedef void (* async_devlist_handler)  (tDeviceInfo * dev_ist, uint8_t count);
+// Whole registry, entries with an event (NRF_DEV_xxx) are the changes
+typedef void (* async_devlist_handler)  (const tDeviceEntry * dev_list, uint16_t count);
+
+// Auto channel moved the controller, the config should follow
+typedef void (* async_autochan_handler) (NrfChan chanid);
 
 class WnrfDriver {
  public:
-    int begin(NrfBaud baud, NrfChan chanid,int size);
+    int begin(NrfBaud baud, NrfChan chanid,int size, uint8_t universes = 1, bool shared = false);
     int begin();
     void show();
+    void commit();
     uint8_t* getData();
     uint8_t* getNrfHistogram();
 
@@ -109,12 +300,19 @@ class WnrfDriver {
     void printIt(void);
     void enableAdmin(void);
     void disableAdmin(void);
+    void setKeepAlive(uint16_t ms);
+    void setDmxShare(uint8_t pct);
+    void setAutoChan(uint8_t mode, uint8_t wifi_chan);
+    void setCompress(uint8_t mode);
+    void setLatch(bool latch);
+    void setFec(uint8_t groups);
 
     int  nrf_bind            (tDevId devId, uint8_t reason, void * context);
-    int  nrf_flash           (tDevId devId, char *fname, void * context);
+    int  nrf_flash           (tDevId devId, const char *fname, void * context);
     int  nrf_rfchan_update   (tDevId devId, uint8_t chan,  void * context);
     int  nrf_devid_update    (tDevId devId, tDevId newId,void * context);
     int  nrf_startaddr_update(tDevId devId, uint16_t start, void * context);
+    int  nrf_fleetflash      (uint8_t type, uint8_t apm, const char *fname, void * context);
 
     // Async Functions - callback context
     async_bind_handler      nrf_async_bind;
@@ -123,26 +321,61 @@ class WnrfDriver {
     async_devid_handler     nrf_async_devid;
     async_startaddr_handler nrf_async_startaddr;
     async_devlist_handler   nrf_async_devlist;
+    async_autochan_handler  nrf_async_autochan;
 
     void sendNewDevId (tDevId  devId, tDevId  newId);
     void sendNewRFChan(tDevId  devId, uint8_t  chanId);
 
     int  clearContext(void * context);
 
-    /* Set channel value at address */
+    /* Device registry - everything that has answered a beacon */
+    inline const tDeviceEntry * getDevices(uint16_t *count) {
+        *count = gdevice_count;
+        return gdevices;
+    }
+    const tDeviceEntry * getDevice(tDevId devId);
+    uint8_t replyRate(const tDeviceEntry *dev);
+
+    /* Auto channel - lower scores are cleaner, 0 when not scored */
+    inline NrfChan bestChan(void) { return gbest_chan; }
+    inline uint16_t chanScore(NrfChan chanid) { return gchan_score[(uint8_t) chanid]; }
+
+    /* Radio counters and histograms, see tNrfStats */
+    inline const tNrfStats * getStats(void) { return &gstats; }
+    void resetStats(void);
+    static const char * ackStateName(uint8_t index);
+
+    /* Copy a run of channel values starting at address (see WnrfDriver.cpp) */
+    void setRange(uint16_t address, const uint8_t *data, uint16_t len);
+
+    /*
+     * Set channel value at address, flag the block if it changed. Legacy
+     * and full mode share this path, begin() sets the layout so a legacy
+     * frame is a single headerless block of universe 0.
+     */
     inline void setValue(uint16_t address, uint8_t value) {
-        if (gnum_channels == 32) {
-	   if (address<32) _dmxdata[address] = value;
-        } else {
-           _dmxdata[1+((address/31)<<5)+(address%31)] = value;
+        if (address < gnum_channels) {
+           uint8_t  universe = address >> 9;    // 512 channels per universe
+           uint16_t channel  = address & 0x1FF;
+           uint8_t  block    = (channel*glayout_mul) >> 16;
+           uint16_t index    = (universe*NRF_UNIVERSE_BYTES)+glayout_hdr+channel+block;
+           if (_dmxdata[index] != value) {
+              _dmxdata[index] = value;
+              _universe[universe].dirty |= (1UL<<block);
+           }
         }
     }
 
     inline bool canRefresh() {
-        if (gnum_channels == 32) {
+        if (glegacy) {
             return (millis() - gstart_time) >= 22;
         } else {
-            return (micros() - gstart_time) >= 665; //Practical vs Theoretical 1336;
+            // Keep feeding the FIFO while a universe is on air, then pace
+            // the next universe by the per block budget. In admin mode the
+            // budget is stretched to leave the rest of the air time free
+            uint32_t budget = gtx_blocks*NRF_BLOCK_US;
+            if (gadmin) budget = budget*100/gdmx_share;
+            return gtx_active || (micros() - gstart_time) >= budget;
         }
     }
 
@@ -150,7 +383,61 @@ class WnrfDriver {
     // Global Variables
     uint32_t    gstart_time;    // When the last frame TX started
     uint16_t	gnum_channels;  // Amount of DMX data to transmit
+    bool        glegacy;        // Legacy mode, one 32 channel payload
+    uint8_t     glayout_hdr;    // Header bytes ahead of each block (1, legacy 0)
+    uint8_t     glayout_chans;  // Channels per block (31, legacy 32)
+    uint16_t    glayout_mul;    // NRF_DIV31_MUL, legacy 0 (everything in block 0)
     uint8_t	gnext_packet;   // Packet index for next frame
+    uint32_t    gtx_mask;       // Blocks of this cycle not yet in the TX FIFO
+    uint8_t     gtx_blocks;     // Blocks in the current cycle, for pacing
+    uint8_t     gtx_inflight;   // Blocks loaded since the last TX complete IRQ
+    bool        gtx_active;     // Radio held in TX mode streaming a universe
+    uint8_t     gtx_universe;   // Universe of the current (or last) cycle
+    uint8_t     grf_chan;       // Channel the radio is currently tuned to
+    uint64_t    gtx_addr;       // Writing pipe address the radio holds
+    bool        gtx_autoack;    // Pipe 0 auto-ack, only on for p2p writes
+    bool        glistening;     // Radio in RX, otherwise TX standby
+
+    tNrfUniverse _universe[NRF_MAX_UNIVERSES];
+    uint8_t     gnum_universes; // Universes being driven
+    bool        gshared_chan;   // All universes on chanid, told apart by the header
+    uint32_t    gcommit_time;   // millis() of the last frame swap
+    bool        gframe_ready;   // End of frame seen, swap at the next cycle
+    uint16_t    gkeepalive;     // ms before an unchanged block is resent
+    uint8_t     gdmx_share;     // % of air time for DMX while in admin
+    uint32_t    gcycle_start;   // micros() the current cycle started loading
+    uint8_t     gcompress;      // NRF_ZIP_xxx
+    bool        gzip;           // Compressed packets in use, see updateCompress()
+    uint8_t     gzip_count;     // Compressed packets in this cycle
+    uint8_t     gzip_next;      // Next one to load into the FIFO
+    uint8_t     gzip_len[NRF_ZIP_MAX];
+    uint8_t     gzip_pkt[NRF_ZIP_MAX][32];
+    bool        glatch;         // End each cycle with a NRF_HDR_LATCH packet
+    bool        glatch_pending; // This cycle's latch is not in the FIFO yet
+    uint8_t     glatch_pkt[32];
+    uint8_t     gfec_groups;    // Parity groups per cycle, 0 none
+    uint8_t     gfec_count;     // Parity packets in this cycle
+    uint8_t     gfec_next;
+    uint8_t     gfec_pkt[NRF_FEC_MAX][32];
+    uint16_t    gscan_energy[NRF_SCAN_CHANNELS]; // Decaying carrier detect rate, 8.8
+    uint8_t     gscan_map[NRF_SCAN_CHANNELS];    // Top byte of the above, for the UI
+    uint8_t     gscan_chan;     // Channel sampled next
+    uint8_t     gscan_home;     // Channel to go back to after the sample
+    bool        gscan_on;       // UI is looking at the spectrum
+    bool        gscan_dwell;    // Radio is listening on gscan_chan
+    uint32_t    gscan_request;  // millis() the UI last asked for the map
+    uint32_t    gscan_time;     // micros() the dwell (or the gap after it) started
+    uint8_t     gautochan;      // NRF_AUTOCHAN_xxx
+    uint8_t     gwifi_chan;     // Our Wi-Fi channel (1..14), 0 when unknown
+    NrfChan     gbest_chan;     // Best scoring channel
+    uint8_t     gbest_count;    // Scorings in a row it beat the current one
+    uint16_t    gchan_score[8]; // Per NrfChan, the universes it would carry
+    uint8_t     gchan_loss[8];  // Per NrfChan, client loss seen there (%)
+    uint32_t    gautochan_time; // millis() of the last scoring
+    uint16_t    gautochan_beacon; // Beacon count at the last scoring
+    uint8_t     gmigrate_rf;    // RF channel the clients are being moved to, 0 when not
+    tDevId      gmigrate_next;  // Lowest dev_id not yet told
+    tNrfStats   gstats;
 
     tPipeInfo  gPipes[MAX_P2P_PIPES];
 
@@ -159,16 +446,21 @@ class WnrfDriver {
     uint32_t	gbeacon_bind_timeout;
     uint32_t	gbeacon_client_response_timeout;
 
-    uint8_t*    _dmxdata;       // Full Universe
+    uint8_t*    _dmxdata;       // All Universes - back buffer, written by ingest
+    uint8_t*    _txdata;        // All Universes - front buffer, being transmitted
 
     uint8_t     gled_count;      // For LED based feedback
     uint8_t     gled_state;      // Blink approx 1 per second
     bool        gadmin;
     uint8_t     gctl_state;      // Tracking NRF client transaction
 
-    tDeviceInfo gdevice_list[10];
-    uint8_t     gdevice_count;
+    tDeviceEntry *gdevices;      // Registry, sorted by dev_id
+    uint16_t    gdevice_count;
+    uint16_t    gdevice_alloc;   // Entries allocated
+    uint16_t    gbeacon_count;   // Beacons sent, for the reply rate
     bool	gbeacon_active;
+    uint8_t     gsession_next;   // Pipe whose turn it is in serviceSessions()
+    tFleetSession *gfleet;       // Broadcast OTA in progress, NULL when none
 
     // Global Config
     NrfBaud  conf_baudrate;
@@ -177,8 +469,38 @@ class WnrfDriver {
     // Functions
     void setBaud(NrfBaud baud);
     void setChan(NrfChan chanid);
+    void tuneRadio(uint8_t rf_chan);
+    void radioListen(bool listen);
+    void radioTarget(uint64_t addr, bool autoack);
+    bool rxNeeded(void);
+    void swapFrame(void);
+    uint32_t txSchedule(uint8_t universe);
+    uint8_t blockLen(uint8_t universe, uint8_t block);
+    inline uint8_t latchLen(void) {
+#ifdef NRF_DYNAMIC_PAYLOAD
+        return NRF_LATCH_LEN;
+#else
+        return 32;
+#endif
+    }
+    void zipSchedule(uint8_t universe);
+    void latchSchedule(uint8_t universe, uint32_t mask);
+    void fecSchedule(uint8_t universe, uint32_t mask);
+    const uint8_t * txNext(uint8_t *len);
+    inline bool txPending(void) {
+        return gtx_mask || (gzip_next < gzip_count) || (gfec_next < gfec_count) || glatch_pending;
+    }
+    void updateCompress(void);
+    bool txFifoFree(void);
+    void txService(void);
+    void txFlush(void);
+    bool txWrite(const void *buf, bool multicast, int8_t pipe = -1);
+    void p2pBegin(tDevId addr, bool autoack);
+    void p2pEnd(void);
     bool sendGenericCmd(uint8_t pipe, uint8_t cmd, uint16_t value);
-    void parseNrf_x88(uint8_t *data);
+    void parseNrf_x88(uint8_t *data, bool strong);
+    void parseTelemetry(tDeviceEntry *dev, const uint8_t *data);
+    int  findDevice(tDevId devId);
 
     int  storeContext(void * context);
     int  getContext(uint8_t pipeid, void **context);
@@ -189,12 +511,41 @@ class WnrfDriver {
     bool tx_commit(uint8_t pipe);
     bool tx_audit(uint8_t pipe);
     bool tx_reset(uint8_t pipe);
+    bool tx_window(uint8_t pipe);
+    void tx_windowresend(uint8_t pipe, uint32_t map, bool all);
+    void closeWindow(uint8_t pipe);
+    bool loadRecord(uint8_t pipe);
+    void serviceSessions(void);
+    void endSession(uint8_t pipe);
+    void updateBeacon(void);
+    bool serviceScan(void);
+    void scanAbort(void);
+    uint8_t  scanEnergy(uint8_t rf_chan);
+    uint16_t scoreChan(NrfChan chanid);
+    void serviceAutoChan(void);
+    void migrateChan(void);
+    bool deviceBusy(tDevId devId);
+
+    /* Another record (two packets) fits in the window */
+    static inline bool windowRoom(const tOtaWindow *win) {
+        return win && !win->eof && ((uint8_t)(win->next - win->base) <= NRF_OTA_WINDOW-2);
+    }
+    uint8_t deviceBlv(tDevId devId);
+
+    void serviceFleet(void);
+    bool fleetRequest(uint8_t index, uint8_t op);
+    bool fleetRecord(uint16_t record, tDevId addr, bool p2p);
+    void fleetResult(uint8_t index, int result);
+    void fleetMissed(void);
+    void fleetEnd(void);
+    void rx_fleet(uint8_t *payload);
 
-    void rx_ackbind(uint8_t pipe);
+    void rx_ackbind(uint8_t pipe, uint8_t *payload);
     void rx_acksetup(uint8_t pipe);
     void rx_ackwrite(uint8_t pipe);
     void rx_ackcommit(uint8_t pipe);
     void rx_ackaudit(uint8_t pipe, char result);
+    void rx_ackwindow(uint8_t pipe, uint8_t *payload);
 
     void openBindPipe(uint8_t);
     void sendDeviceList(void);
@@ -0,0 +1,89 @@
+/*
+* Arduino.h - Host side stand-in for the parts of the ESP8266 core used by
+*             WnrfDriver, DmxIngest and HexParser
+*
+* author: Andrew Williams (LabRat)
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*
+* Only used by the host harness (see host/Makefile). Time comes from the
+* simulated air: millis() and micros() read SimAir::now_us and delay()
+* moves it on. GPIO writes go nowhere, attachInterrupt() wires the handler
+* to the simulated IRQ line. Serial goes to host_log, NULL drops it.
+*/
+
+#ifndef HOST_ARDUINO_H_
+#define HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "../RF24Sim.h"
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define HIGH    (1)
+#define LOW     (0)
+#define INPUT   (0)
+#define OUTPUT  (1)
+#define FALLING (2)
+#define DEC     (10)
+#define HEX     (16)
+
+#define F(s)    (s)
+#define ICACHE_RAM_ATTR
+#define digitalPinToInterrupt(pin) (pin)
+
+inline uint32_t millis(void) { return sim_air.now_us / 1000; }
+inline uint32_t micros(void) { return sim_air.now_us; }
+inline void delay(uint32_t ms) { sim_air.advance(ms * 1000); }
+inline void delayMicroseconds(uint32_t us) { sim_air.advance(us); }
+inline void yield(void) {}
+
+inline void pinMode(uint8_t pin, uint8_t mode) { (void) pin; (void) mode; }
+inline void digitalWrite(uint8_t pin, uint8_t val) { (void) pin; (void) val; }
+inline void attachInterrupt(uint8_t pin, void (*handler)(void), int mode) {
+    (void) pin;
+    (void) mode;
+    sim_air.irq = handler;
+}
+
+extern FILE *host_log;
+
+class HostSerial {
+ public:
+    void print(const char *s) { if (host_log) fputs(s, host_log); }
+    void print(char c) { if (host_log) fputc(c, host_log); }
+    void print(long n, int base = DEC) {
+        if (host_log) fprintf(host_log, (base == HEX) ? "%lX" : "%ld", n);
+    }
+    void print(unsigned long n, int base = DEC) {
+        if (host_log) fprintf(host_log, (base == HEX) ? "%lX" : "%lu", n);
+    }
+    void print(int n, int base = DEC) { print((long) n, base); }
+    void print(unsigned int n, int base = DEC) { print((unsigned long) n, base); }
+    void print(unsigned char n, int base = DEC) { print((unsigned long) n, base); }
+
+    void println(void) { print("\n"); }
+    template <typename T> void println(T v) { print(v); println(); }
+    template <typename T> void println(T v, int base) { print(v, base); println(); }
+
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+};
+
+extern HostSerial Serial;
+
+#endif /* HOST_ARDUINO_H_ */
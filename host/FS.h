@@ -0,0 +1,91 @@
+/*
+* FS.h - Host side stand-in for the SPIFFS File API
+*
+* author: Andrew Williams (LabRat)
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*
+* SPIFFS has a flat name space, "/16i/image.bin" is stored on the host as
+* <root>/_16i_image.bin. As on the ESP a File is a handle, copies share
+* the open file and only one of them should be closed.
+*/
+
+#ifndef HOST_FS_H_
+#define HOST_FS_H_
+
+#include "Arduino.h"
+
+enum SeekMode {
+    SeekSet = SEEK_SET,
+    SeekCur = SEEK_CUR,
+    SeekEnd = SEEK_END
+};
+
+class File {
+ public:
+    File(FILE *fp = NULL) : _fp(fp) {}
+
+    operator bool() const { return _fp != NULL; }
+
+    int available(void) {
+        if (!_fp) return 0;
+        long pos = ftell(_fp);
+        fseek(_fp, 0, SEEK_END);
+        long end = ftell(_fp);
+        fseek(_fp, pos, SEEK_SET);
+        return end - pos;
+    }
+    int read(uint8_t *buf, size_t len) { return _fp ? fread(buf, 1, len, _fp) : 0; }
+    size_t readBytes(char *buf, size_t len) { return read((uint8_t *) buf, len); }
+    size_t write(const uint8_t *buf, size_t len) { return _fp ? fwrite(buf, 1, len, _fp) : 0; }
+    bool seek(uint32_t pos, SeekMode mode) { return _fp && !fseek(_fp, pos, mode); }
+    size_t position(void) { return _fp ? ftell(_fp) : 0; }
+    void close(void) {
+        if (_fp) fclose(_fp);
+        _fp = NULL;
+    }
+
+ private:
+    FILE *_fp;
+};
+
+class HostFS {
+ public:
+    HostFS() : _root(".") {}
+
+    void begin(const char *root) { _root = root; }
+
+    File open(const char *path, const char *mode) {
+        char name[256];
+        return File(fopen(hostName(path, name, sizeof(name)), mode));
+    }
+    bool remove(const char *path) {
+        char name[256];
+        return !::remove(hostName(path, name, sizeof(name)));
+    }
+
+ private:
+    const char *_root;
+
+    const char * hostName(const char *path, char *name, size_t size) {
+        int n = snprintf(name, size, "%s/", _root);
+        for (; *path && (n < (int) size - 1); path++) {
+            name[n++] = (*path == '/') ? '_' : *path;
+        }
+        name[n] = 0;
+        return name;
+    }
+};
+
+extern HostFS SPIFFS;
+
+#endif /* HOST_FS_H_ */
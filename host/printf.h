@@ -0,0 +1,11 @@
+/*
+* printf.h - Host side stand-in for the RF24 printf helper, stdout is
+*            already there
+*/
+
+#ifndef HOST_PRINTF_H_
+#define HOST_PRINTF_H_
+
+inline void printf_begin(void) {}
+
+#endif /* HOST_PRINTF_H_ */
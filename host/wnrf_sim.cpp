@@ -0,0 +1,433 @@
+/*
+* wnrf_sim.cpp - Host benchmark harness for WnrfDriver
+*
+* author: Andrew Williams (LabRat)
+*
+*  This program is provided free for you to use in any way that you wish,
+*  subject to the laws and regulations where you are using it.  Due diligence
+*  is strongly suggested before using this code.  Please give credit where due.
+*
+*  The Author makes no warranty of any kind, express or implied, with regard
+*  to this program or the documentation contained in this document.  The
+*  Author shall not be liable in any event for incidental or consequential
+*  damages in connection with, or arising out of, the furnishing, performance
+*  or use of these programs.
+*
+*
+* Runs the driver the way loop() does - ingest, show() when canRefresh(),
+* checkRx() - against RF24Sim's simulated air and client nodes, for a fixed
+* span of virtual time. Frames come in through DmxIngest as E1.31 would
+* deliver them, one feed per universe with the last one committing.
+* At the end SimAir::report() and the driver counters are printed, so a
+* change to the driver can be measured without flashing anything.
+*
+* The OTA runs (-o, -O) write an Intel HEX of the given size to the host
+* SPIFFS directory and build the binary image from it as the UI does.
+*/
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "FS.h"
+#include "../WnrfDriver.h"
+#include "../DmxIngest.h"
+#include "../HexParser.h"
+
+FILE       *host_log = NULL;
+HostSerial  Serial;
+HostFS      SPIFFS;
+
+static WnrfDriver out_driver;
+static DmxIngest  ingest;
+
+#define LOSS_FIGURES (8)
+
+static struct {
+    uint32_t secs;
+    bool     legacy;
+    uint16_t channels;
+    uint8_t  universes;
+    bool     shared;
+    uint8_t  chan;      // NrfChan
+    uint16_t fps;       // Frames fed per second
+    uint16_t changing;  // Channels that change every frame (a chase)
+    uint8_t  compress;
+    bool     latch;
+    uint8_t  fec;
+    uint8_t  nodes;
+    uint8_t  loss[LOSS_FIGURES];  // Packet loss at node n, the last one repeats
+    uint8_t  losses;
+    uint8_t  blv;
+    bool     admin;
+    bool     spectrum;  // Poll the spectrum map as the UI does
+    uint8_t  autochan;
+    uint8_t  wifi;      // Wi-Fi channel for the auto channel scoring
+    uint16_t ota;       // Records in the image flashed to every node
+    uint16_t fleet;     // ... broadcast to every node
+} opt = { 5, false, 0, 1, false, (uint8_t) NrfChan::NRFCHAN_D, 40, 0,
+          NRF_ZIP_OFF, false, 0, 1, { 0 }, 1, 1, false, false, NRF_AUTOCHAN_OFF, 0, 0, 0 };
+
+static const char *spiffs_root = "spiffs";
+
+static uint32_t loop_max_us;  // Longest pass through the loop
+
+static uint32_t pushes;       // Registry pushes
+static uint32_t events[NRF_DEV_GONE+1];  // ... and the NRF_DEV_xxx events in them
+
+static uint64_t ota_start;
+static uint64_t ota_done;
+static uint8_t  ota_results;
+static uint8_t  ota_failed;
+
+static void otaResult(tDevId devId, void *context, int result) {
+    (void) context;
+    if (result != 1) ota_failed++;
+    ota_results++;
+    ota_done = sim_air.now_us;
+    printf("OTA %6.6X  : result %d after %.3f s\n", devId, result,
+           (ota_done - ota_start) / 1000000.0);
+}
+
+static void devList(const tDeviceEntry *dev_list, uint16_t count) {
+    pushes++;
+    for (int i = 0; i < count; i++) {
+        if (dev_list[i].event <= NRF_DEV_GONE) events[dev_list[i].event]++;
+    }
+}
+
+static void autoChan(NrfChan chanid) {
+    printf("Auto channel : moved to %d after %.1f s\n", (int) chanid,
+           (sim_air.now_us - sim_air.start_us) / 1000000.0);
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: wnrf_sim [options]\n"
+        "  -t secs      virtual time to run (5)\n"
+        "  -L           legacy mode (32 channels on 80)\n"
+        "  -c channels  full mode channels (512 per universe)\n"
+        "  -u n         universes, one RF channel each from -C (1)\n"
+        "  -s           universes share one RF channel\n"
+        "  -C n         NrfChan id 1..7 (4 = 76)\n"
+        "  -r fps       frames fed per second (40)\n"
+        "  -k n         channels changing every frame (0, a static scene)\n"
+        "  -z off|auto|on  compressed packets\n"
+        "  -l           frame latch\n"
+        "  -f n         parity groups per cycle\n"
+        "  -n n         client nodes (1)\n"
+        "  -p pct[,pct] packet loss at each node, the last figure repeats\n"
+        "  -N lo[-hi]:pct  carrier on RF channels lo..hi, pct of the time\n"
+        "  -S           poll the spectrum map every 250ms, as the UI does\n"
+        "  -A advise|move  automatic channel selection\n"
+        "  -W n         our Wi-Fi channel, for -A\n"
+        "  -b blv       node bootloader version (1)\n"
+        "  -a           admin mode, beacons and client telemetry\n"
+        "  -o records   flash an image of that size to every node\n"
+        "  -O records   broadcast an image of that size to every node (-b 3)\n"
+        "  -v           driver log on stderr\n");
+    exit(1);
+}
+
+/* -p 5 or -p 0,5,20,50 */
+static void parseLoss(char *arg) {
+    opt.losses = 0;
+    for (char *s = strtok(arg, ","); s && (opt.losses < LOSS_FIGURES); s = strtok(NULL, ","))
+        opt.loss[opt.losses++] = atoi(s);
+    if (!opt.losses) usage();
+}
+
+/* -N 30-39:80 or -N 60:30 */
+static void parseNoise(const char *arg) {
+    int lo, hi, pct;
+
+    if (sscanf(arg, "%d-%d:%d", &lo, &hi, &pct) != 3) {
+        if (sscanf(arg, "%d:%d", &lo, &pct) != 2) usage();
+        hi = lo;
+    }
+    if ((lo < 0) || (lo > hi) || (hi >= (int) sizeof(sim_air.noise))) usage();
+    for (int ch = lo; ch <= hi; ch++) sim_air.noise[ch] = pct;
+}
+
+static void parseArgs(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "t:Lc:u:sC:r:k:z:lf:n:p:N:SA:W:b:ao:O:v")) != -1) {
+        switch (c) {
+            case 't': opt.secs = atoi(optarg); break;
+            case 'L': opt.legacy = true; break;
+            case 'c': opt.channels = atoi(optarg); break;
+            case 'u': opt.universes = atoi(optarg); break;
+            case 's': opt.shared = true; break;
+            case 'C': opt.chan = atoi(optarg); break;
+            case 'r': opt.fps = atoi(optarg); break;
+            case 'k': opt.changing = atoi(optarg); break;
+            case 'z':
+                opt.compress = !strcmp(optarg, "on") ? NRF_ZIP_ON :
+                               !strcmp(optarg, "auto") ? NRF_ZIP_AUTO : NRF_ZIP_OFF;
+                break;
+            case 'l': opt.latch = true; break;
+            case 'f': opt.fec = atoi(optarg); break;
+            case 'n': opt.nodes = atoi(optarg); break;
+            case 'p': parseLoss(optarg); break;
+            case 'N': parseNoise(optarg); break;
+            case 'S': opt.spectrum = true; break;
+            case 'A':
+                opt.autochan = !strcmp(optarg, "move") ? NRF_AUTOCHAN_MIGRATE :
+                               !strcmp(optarg, "advise") ? NRF_AUTOCHAN_ADVISE : NRF_AUTOCHAN_OFF;
+                break;
+            case 'W': opt.wifi = atoi(optarg); break;
+            case 'b': opt.blv = atoi(optarg); break;
+            case 'a': opt.admin = true; break;
+            case 'o': opt.ota = atoi(optarg); break;
+            case 'O': opt.fleet = atoi(optarg); break;
+            case 'v': host_log = stderr; break;
+            default:  usage();
+        }
+    }
+    if ((opt.chan < 1) || (opt.chan > (uint8_t) NrfChan::NRFCHAN_G)) usage();
+    if ((opt.universes < 1) || (opt.universes > NRF_MAX_UNIVERSES)) usage();
+    if (opt.legacy) opt.channels = 32;
+    if (!opt.channels) opt.channels = opt.universes*512;
+    if (opt.channels == 32) opt.channels = opt.legacy ? 32 : 33;
+    if (opt.universes*512 < opt.channels) opt.universes = (opt.channels + 511)/512;
+    if (opt.ota || opt.fleet) opt.admin = true;
+    if (opt.autochan) opt.admin = true;
+}
+
+/* Intel HEX of 'records' 32 byte rows from word address 0x0200 */
+static bool writeHex(uint16_t records) {
+    File hex = SPIFFS.open("/16f/sim.hex", "w");
+    if (!hex) return false;
+
+    for (uint16_t r = 0; r < records; r++) {
+        for (int half = 0; half < 2; half++) {
+            uint16_t addr = 0x0400 + r*32 + half*16;
+            uint8_t  sum = 16 + (addr >> 8) + (addr & 0xFF);
+            char     line[48];
+            int      n = sprintf(line, ":10%4.4X00", addr);
+
+            for (int i = 0; i < 16; i++) {
+                uint8_t b = (r*7 + half*16 + i) & 0xFF;
+                sum += b;
+                n += sprintf(&line[n], "%2.2X", b);
+            }
+            sprintf(&line[n], "%2.2X\n", (uint8_t) -sum);
+            hex.write((const uint8_t *) line, strlen(line));
+        }
+    }
+    hex.write((const uint8_t *) ":00000001FF\n", 12);
+    hex.close();
+    return true;
+}
+
+/* As buildFWImage() in WNRF.ino */
+static int buildImage(uint16_t records) {
+    int rc = -1;
+
+    if (!writeHex(records)) return rc;
+    File hex = SPIFFS.open("/16f/sim.hex", "r");
+    File tmp = SPIFFS.open(LHE_IMAGE_TEMP, "w+");
+    File img = SPIFFS.open(LHE_IMAGE_FILE, "w");
+    if (hex && tmp && img)
+        rc = lhe_build_image(&hex, &tmp, &img);
+    if (hex) hex.close();
+    if (tmp) tmp.close();
+    if (img) img.close();
+    SPIFFS.remove(LHE_IMAGE_TEMP);
+    return rc;
+}
+
+static void addNodes(void) {
+    for (int i = 0; i < opt.nodes; i++) {
+        uint8_t u = opt.legacy ? 0 : i % opt.universes;
+        tSimNode *node = sim_air.addNode(0x100001 + i, 0x01, opt.blv, 0x01, NRF_ZIP_APV);
+        if (!node) break;
+        node->loss = opt.loss[(i < opt.losses) ? i : opt.losses-1];
+        node->latch = opt.latch || opt.fec;
+        node->telemetry = true;
+        if (opt.legacy) {
+            node->rf_chan = 80;
+        } else if (opt.shared) {
+            node->rf_chan = 68 + 2*opt.chan;
+            node->start = u*512;
+        } else {
+            node->rf_chan = 68 + 2*(opt.chan + u);
+        }
+    }
+}
+
+/* A chase of opt.changing channels walking through the frame */
+static void feedFrame(uint32_t frame) {
+    static uint8_t data[NRF_MAX_UNIVERSES][512];
+    uint8_t universes = opt.legacy ? 1 : opt.universes;
+
+    for (uint16_t i = 0; i < opt.changing; i++) {
+        uint16_t ch = (frame*opt.changing + i) % opt.channels;
+        data[ch >> 9][ch & 0x1FF] = frame + i;
+    }
+    for (uint8_t u = 0; u < universes; u++) {
+        ingest.feed(IngestSrc::E131, u, u*512, data[u], opt.legacy ? 32 : 512, frame,
+                    INGEST_SEQ | ((u == universes-1) ? INGEST_COMMIT : 0));
+    }
+}
+
+static void printHist(const char *name, const tNrfHist *hist) {
+    if (!hist->count) return;
+    printf("%-13s: %u, avg %.0f us, max %u us\n", name, hist->count,
+           (double) hist->total_us / hist->count, hist->max_us);
+}
+
+static bool seen(tDevId dev_id) {
+    uint16_t count;
+    const tDeviceEntry *dev = out_driver.getDevices(&count);
+
+    for (int i = 0; i < count; i++) {
+        if (dev[i].info.dev_id == dev_id) return true;
+    }
+    return false;
+}
+
+/* Whether the -o flash of node i can be started */
+static bool otaReady(uint8_t i) {
+    // Flash once the device is in the registry, as the UI would. Windowed
+    // OTA then has the bootloader version from the beacon reply as well as
+    // from the bind ACK.
+    return (opt.blv < NRF_OTA_BLV_WINDOW) || seen(sim_air.nodes[i].dev_id);
+}
+
+static void report(void) {
+    const tNrfStats *st = out_driver.getStats();
+    uint16_t count;
+    const tDeviceEntry *dev = out_driver.getDevices(&count);
+    double secs = (sim_air.now_us - sim_air.start_us) / 1000000.0;
+
+    sim_air.report(stdout);
+    printf("Loop max     : %u us\n", loop_max_us);
+    if (opt.spectrum) {
+        const uint8_t *map = out_driver.getNrfHistogram();
+
+        printf("Spectrum     :");
+        for (int ch = 0; ch < NRF_SCAN_CHANNELS; ch++) {
+            if (map[ch]) printf(" %d:%u", ch, map[ch]);
+        }
+        printf("\n");
+    }
+    printf("TX blocks    : %u (%u zipped)\n", st->tx_blocks, st->tx_zipped);
+    for (int u = 0; u < opt.universes; u++) {
+        printf("Cycles U%d    : %u (%.1f /s)\n", u, st->cycles[u], st->cycles[u] / secs);
+    }
+    printHist("Write", &st->write_us);
+    printHist("Load", &st->load_us);
+    printHist("Cycle", &st->cycle_us);
+    for (int i = 0; i < NRF_ACK_STATES; i++) {
+        char name[24];
+        snprintf(name, sizeof(name), "ACK %s", WnrfDriver::ackStateName(i));
+        printHist(name, &st->ack_us[i]);
+    }
+    for (int i = 0; i < sim_air.node_count; i++) {
+        tSimNode *node = &sim_air.nodes[i];
+        if (node->latches || node->fec_fixed) {
+            printf("Node %6.6X  : %u latches, %u gaps, %u short, %u rebuilt\n", node->dev_id,
+                   node->latches, node->latch_gaps, node->latch_short, node->fec_fixed);
+        }
+    }
+    if (pushes) {
+        printf("Registry     : %u pushes, %u new, %u changed, %u gone\n", pushes,
+               events[NRF_DEV_NEW], events[NRF_DEV_CHANGED], events[NRF_DEV_GONE]);
+    }
+    if (opt.autochan) {
+        printf("Chan scores  :");
+        for (int id = 1; id <= (int) NrfChan::NRFCHAN_G; id++)
+            printf(" %d:%u", id, out_driver.chanScore(NrfChan(id)));
+        printf(", best %d\n", (int) out_driver.bestChan());
+    }
+    for (int i = 0; i < count; i++) {
+        char loss[8] = "-";
+        if (dev[i].loss != NRF_LOSS_UNKNOWN) snprintf(loss, sizeof(loss), "%u%%", dev[i].loss);
+        printf("Device %6.6X: %u replies, link %u%%, rx %u tx %u, loss %s, missed %u, short %u\n",
+               dev[i].info.dev_id, dev[i].replies, dev[i].link*10, dev[i].rx_packets,
+               dev[i].tx_packets, loss, dev[i].frames_missed, dev[i].frames_short);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t end, next_frame = 0, next_scan = 0;
+    uint32_t frame = 0;
+    uint8_t  ota_sent = 0;      // Flashes started
+
+    parseArgs(argc, argv);
+    mkdir(spiffs_root, 0755);
+    SPIFFS.begin(spiffs_root);
+
+    if (opt.ota || opt.fleet) {
+        int records = buildImage(opt.ota ? opt.ota : opt.fleet);
+        if (records <= 0) {
+            fprintf(stderr, "OTA image build failed: %d\n", records);
+            return 1;
+        }
+    }
+
+    addNodes();
+    if (opt.legacy) {
+        out_driver.begin();
+    } else {
+        out_driver.begin(NrfBaud::BAUD_2Mbps, NrfChan(opt.chan), opt.channels,
+                         opt.universes, opt.shared);
+    }
+    out_driver.setCompress(opt.compress);
+    out_driver.setLatch(opt.latch && !opt.legacy);
+    out_driver.setFec(opt.fec);
+    out_driver.nrf_async_otaflash = otaResult;
+    out_driver.nrf_async_devlist = devList;
+    out_driver.nrf_async_autochan = autoChan;
+    out_driver.setAutoChan(opt.autochan, opt.wifi);
+    ingest.begin(&out_driver, opt.channels, opt.legacy ? 1 : opt.universes);
+    if (opt.admin) out_driver.enableAdmin();
+
+    sim_air.start_us = sim_air.now_us;
+    end = sim_air.now_us + (uint64_t) opt.secs * 1000000;
+    while (sim_air.now_us < end) {
+        uint64_t was = sim_air.now_us;
+
+        if (opt.fps && (sim_air.now_us >= next_frame)) {
+            feedFrame(frame++);
+            next_frame += 1000000 / opt.fps;
+        }
+
+        if (opt.ota && (ota_sent < sim_air.node_count) && otaReady(ota_sent)) {
+            tDevId dev_id = sim_air.nodes[ota_sent].dev_id;
+
+            if (!ota_sent) ota_start = sim_air.now_us;
+            if (out_driver.nrf_flash(dev_id, LHE_IMAGE_FILE, &opt) >= 0) ota_sent++;
+        }
+        if (!ota_sent && opt.fleet) {
+            uint16_t count;
+            out_driver.getDevices(&count);
+            if (count >= sim_air.node_count) {
+                ota_sent = sim_air.node_count;
+                ota_start = sim_air.now_us;
+                int rc = out_driver.nrf_fleetflash(0x01, 0x01, LHE_IMAGE_FILE, &opt);
+                if (rc < 0) printf("Broadcast OTA refused: %d\n", rc);
+            }
+        }
+        if (ota_sent && (ota_results >= sim_air.node_count)) break;
+
+        if (opt.spectrum && (sim_air.now_us >= next_scan)) {
+            out_driver.getNrfHistogram();
+            next_scan = sim_air.now_us + 250000;
+        }
+        if (out_driver.canRefresh())
+            out_driver.show();
+        out_driver.checkRx();
+        if (sim_air.now_us - was > loop_max_us) loop_max_us = sim_air.now_us - was;
+
+        // The rest of loop() - Wi-Fi, web server - is not free either
+        sim_air.advance((sim_air.now_us == was) ? 20 : 2);
+    }
+
+    report();
+    if ((opt.ota || opt.fleet) && (ota_failed || (ota_results < sim_air.node_count))) {
+        printf("OTA incomplete\n");
+        return 2;
+    }
+    return 0;
+}
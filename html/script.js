@@ -6,7 +6,6 @@ var wsTimerId;
 var devices =[]; // Start with Empty Array
 var wnrfTimerId;
 
-const auditInterval = setInterval(auditDevices, 5000);
 // json with effect definitions
 var effectInfo;
 
@@ -15,10 +14,10 @@ $.fn.modal.Constructor.DEFAULTS.backdrop = 'static';
 $.fn.modal.Constructor.DEFAULTS.keyboard = false;
 
 var admin_ctl=false;
+var ed_device;   // Device in the edit pane
 
 // Histogram
 histData=[];
-histPhase = 0;
 
 for (i=0;i<84;i++) {
    histData.push(0);
@@ -241,6 +240,15 @@ $(function() {
        $('#update').modal();
     });
 
+    // Broadcast OTA to every device with the same type and firmware
+    $('#ota_fleet').click(function() {
+      var json = {
+          'type': ed_device.type,
+          'apm': ed_device.apm
+       };
+       wsEnqueue('D6' + JSON.stringify(json));
+    });
+
 
     // Hostname, SSID, and Password validation
     $('#hostname').keyup(function() {
@@ -462,6 +470,9 @@ function wsConnect() {
                 case 'D4':
                     rxOTAReply(data);
                     break;
+                case 'D6':
+                    rxFleetReply(data);
+                    break;
                 case 'S1':
                     setConfig(data);
                     reboot();
@@ -489,9 +500,12 @@ function wsConnect() {
 
                 if (streamData.length==84) {  // Major hack for now
                    drawHist(streamData);
-                   if ($('#hist').is(':visible')) {
-                      wsEnqueue('V2');
-                   }
+                   // The scan runs on the controller, just refresh the picture
+                   setTimeout(function() {
+                      if ($('#hist').is(':visible')) {
+                         wsEnqueue('V2');
+                      }
+                   }, 250);
                 } else {
                    drawStream(streamData);
                    if ($('#diag').is(':visible')) {
@@ -593,23 +607,12 @@ function drawStream(streamData) {
 }
 
 function drawHist(histStream) {
+    // Each channel is the controller's decaying carrier detect rate, 0..255
     if (typeof ctx2 !== 'undefined') {
+       ctx2.clearRect(0, 0, canvas2.width, canvas2.height);
        ctx2.fillStyle='rgb(0,200,180)';
-       histPhase=(histPhase+1)%5;
-       if (histPhase == 0 ) {
-          ctx2.clearRect(0, 0, canvas2.width, canvas2.height);
-          for (i = 0; i < 84; i++) {
-             if (histData[i]>0){
-                histData[i]--;
-             }
-          }
-       }
-
        for (i = 0; i < 84; i++) {
-           histData[i]+=histStream[i];
-           if (histData[i]>9) {
-              histData[i]=9;
-           }
+           histData[i]=Math.round(histStream[i]*225/255);
            if (i>11) {
               if (((i-12)%5)==0) {
                  ctx2.fillStyle='rgb(2000,200,0)';
@@ -618,7 +621,7 @@ function drawHist(histStream) {
                  ctx2.fillStyle='rgb(0,200,180)';
               }
            }
-           ctx2.fillRect(10+(i*5),250-(histData[i]*25+2),4,(histData[i]*25)+2);
+           ctx2.fillRect(10+(i*5),250-(histData[i]+2),4,histData[i]+2);
            if (i%20==0) {
               ctx2.fillText(i,10+i*5, 270 );
            }
@@ -670,31 +673,33 @@ function showDevices() {
              row.insertCell(2).innerHTML= ((devices[i].apv>>4)&0x0F)+'.'+(devices[i].apv&0x0F);
              row.insertCell(3).innerHTML= devices[i].start;
            }
+           row.insertCell(4).innerHTML= devices[i].link+'%';
+           // Packet loss the device reports, the title holds the recent history
+           var loss = row.insertCell(5);
+           if (typeof devices[i].loss !== 'undefined') {
+              loss.innerHTML = devices[i].loss+'%';
+              loss.title = 'Recent: '+devices[i].hist.join('% ')+'%  Missed frames: '+devices[i].missed+
+                           '  Short frames: '+devices[i].short+'  CRC: '+devices[i].crc;
+           } else {
+              loss.innerHTML = '---';
+           }
            if (admin_ctl) {
-              row.insertCell(4).innerHTML= "<input type=\"radio\" id=\""+devices[i].dev_id+"\" onClick=\"editDevice(\'"+devices[i].dev_id+"\');\">";
+              row.insertCell(6).innerHTML= "<input type=\"radio\" id=\""+devices[i].dev_id+"\" onClick=\"editDevice(\'"+devices[i].dev_id+"\');\">";
            }
     }
 }
 
-function auditDevices() { // a 5 second periodic
-    // Walk the list.. decrement the audit counter, any more more than nn seconds - remove
-    for (var i=0;i<devices.length;i++) {
-       devices[i].audit--;
-       if (devices[i].audit==0) {
-          devices.splice(i,1);
-          i--;  // Needed as the array is now 1 row shorter
-       }
-    }
-    showDevices();
-}
-
+// The WNRF ages the list, it pushes only the devices that are new, changed or gone
 function getDevices(data) {
     var devlist = JSON.parse(data);
 
     for (var i in devlist) {
        // For each parsed device - see if it is already in the array
        var index = devices.findIndex(item => item.dev_id === i);
-       if (index ==-1) {
+       if (devlist[i].event == 'gone') {
+          if (index != -1)
+             devices.splice(index,1);
+       } else if (index ==-1) {
           // This is a new array entry - add to the list
           devices.push({dev_id: i,
                         type:  devlist[i].type,
@@ -702,14 +707,26 @@ function getDevices(data) {
                         apm:   devlist[i].apm,
                         apv:   devlist[i].apv,
                         start: devlist[i].start+1,
-                        audit: 6});
+                        link:  devlist[i].link,
+                        loss:  devlist[i].loss,
+                        hist:  devlist[i].hist,
+                        missed: devlist[i].missed,
+                        short: devlist[i].short,
+                        crc:   devlist[i].crc});
         } else {
-           devices[index].audit=6; // Renew it's lease
+           devices[index].blv = devlist[i].blv;
            devices[index].apm = devlist[i].apm;
            devices[index].apv = devlist[i].apv;
            devices[index].start = devlist[i].start+1;
+           devices[index].link = devlist[i].link;
+           devices[index].loss = devlist[i].loss;
+           devices[index].hist = devlist[i].hist;
+           devices[index].missed = devlist[i].missed;
+           devices[index].short = devlist[i].short;
+           devices[index].crc = devlist[i].crc;
         }
     }
+    showDevices();
 }
 
 function rxAdminReplyDA(data) {
@@ -760,6 +777,16 @@ function rxOTAReply(data) {
     $('#update').modal('hide');
 }
 
+function rxFleetReply(data) {
+    var fleet = JSON.parse(data);
+
+    if (fleet.result > 0) {
+       footermsg("OTA: Broadcast to "+fleet.result+" devices");
+    } else {
+       footermsg("OTA: Broadcast failed ["+fleet.result+"]");
+    }
+}
+
 function rxWnrfuReply(data) {
     var wnrfu = JSON.parse(data);
 
@@ -798,6 +825,7 @@ function editDevice(devid) {
    // Search table for row that matches
 
      var device = devices[devindex];
+     ed_device = device;
 
 
      $('#ed_devid').text(device.dev_id);
@@ -823,6 +851,7 @@ function editDevice(devid) {
      // Enabled the OTA update if ADMIN and HEX file is present
      if (admin_ctl) {
         $('#ota').prop('disabled',($('#nrf_fw').text() === 'none'));
+        $('#ota_fleet').prop('disabled',($('#nrf_fw').text() === 'none') || (device.blv < 3));
      }
 
      // Display the Edit Panes
@@ -891,6 +920,17 @@ function getConfig(data) {
         $('#nrf_legacy').prop('checked', config.wnrf.enabled);
         $('#nrf_chan').val(config.wnrf.nrf_chan);
         $('#nrf_baud').val(config.wnrf.nrf_baud);
+        $('#nrf_keepalive').val(config.wnrf.keepalive);
+        $('#nrf_universes').val(config.wnrf.universes);
+        $('#s_count').val(config.e131.channel_count);
+        $('#nrf_shared').prop('checked', config.wnrf.shared);
+        $('#nrf_dmx_share').val(config.wnrf.dmx_share);
+        $('#nrf_auto').val(config.wnrf.auto_chan);
+        $('#nrf_compress').val(config.wnrf.compress);
+        $('#nrf_latch').prop('checked', config.wnrf.latch);
+        $('#nrf_fec').val(config.wnrf.fec);
+        $('#s_chanid').attr('max', config.wnrf.shared ? config.e131.channel_count : 512);
+        wsEnqueue('D1'); // Device list, changes are pushed after this
         if (config.wnrf.nrf_fw.length>0)
            $('#nrf_fw').text(config.wnrf.nrf_fw);
         else
@@ -990,8 +1030,18 @@ function getJsonStatus(data) {
     $('#perr').text(status.e131.packet_errors);
     $('#clientip').text(status.e131.last_clientIP);
 
+// getIngestStatus
+    if (typeof status.ingest !== 'undefined') {
+        $.each(status.ingest, function(src, st) {
+            $.each(st, function(key, val) {
+                $('#ig_' + src + '_' + key).text(val);
+            });
+        });
+    }
+
 // getNrfStatus
     $('#stat_chan').text(status.nrf.chan);
+    $('#stat_best').text(status.nrf.best ? status.nrf.best : 'Auto channel off');
     $('#stat_rate').text(status.nrf.baud);
     $('#stat_mode').text(status.nrf.mode);
 }
@@ -1070,6 +1120,14 @@ function submitConfig() {
             'wnrf': {
                 'nrf_chan': parseInt($('#nrf_chan').val()),
                 'nrf_baud': parseInt($('#nrf_baud').val()),
+                'keepalive': parseInt($('#nrf_keepalive').val()),
+                'universes': parseInt($('#nrf_universes').val()),
+                'shared': $('#nrf_shared').prop('checked'),
+                'dmx_share': parseInt($('#nrf_dmx_share').val()),
+                'auto_chan': parseInt($('#nrf_auto').val()),
+                'compress': parseInt($('#nrf_compress').val()),
+                'latch': $('#nrf_latch').prop('checked'),
+                'fec': parseInt($('#nrf_fec').val()),
                 'enabled' : $('#nrf_legacy').prop('checked')
             }
     };
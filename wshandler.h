@@ -24,13 +24,15 @@
 #include "WnrfDriver.h"
 extern WnrfDriver out_driver;       // Wnrf object
 #endif
+#include "DmxIngest.h"
+#include "HexParser.h"
 
 extern EffectEngine effects;    // EffectEngine for test modes
 extern char fw_name[40];
 extern ESPAsyncE131 e131;       // ESPAsyncE131 with X buffers
 extern ESPAsyncDDP  ddp;        // ESPAsyncDDP with X buffers
 extern config_t     config;     // Current configuration
-extern uint32_t     *seqError;  // Sequence error tracking for each universe
+extern DmxIngest    ingest;     // Common ingest stage and per protocol stats
 extern uint16_t     uniLast;    // Last Universe to listen for
 extern bool         reboot;     // Reboot flag
 
@@ -52,6 +54,7 @@ AsyncWebSocketClient * ws_edit_client;
     G1 - Get Config
     G2 - Get Config Status
     G3 - Get Current Effect and Effect Config Options
+    G4 - Get Radio Statistics (G4R - and reset them)
 
     T0 - Disable Testing
     T1 - Static Testing
@@ -66,9 +69,11 @@ AsyncWebSocketClient * ws_edit_client;
     V1 - View Stream
 
     NRF Device Editing/Auditing
-    D1 - List of NRF client devices
+    D1 - List of NRF client devices (request for all, then changes pushed)
     D2 - Update Channel Request
     D3 - WS File Upload Return Code
+    D4 - OTA Request
+    D6 - Broadcast OTA Request
     Da/A - enable.disable Device Admin
 
     S1 - Set Network Config
@@ -98,24 +103,34 @@ void procX(uint8_t *data, AsyncWebSocketClient *client) {
 
             // E131 statistics
             JsonObject e131J = json.createNestedObject("e131");
-            uint32_t seqErrors = 0;
-            for (int i = 0; i < ((uniLast + 1) - config.universe); i++)
-                seqErrors =+ seqError[i];
-
             e131J["universe"] = (String)config.universe;
             e131J["uniLast"] = (String)uniLast;
             e131J["num_packets"] = (String)e131.stats.num_packets;
-            e131J["seq_errors"] = (String)seqErrors;
+            e131J["seq_errors"] = (String)ingest.getStats(IngestSrc::E131)->seq_errors;
             e131J["packet_errors"] = (String)e131.stats.packet_errors;
             e131J["last_clientIP"] = e131.stats.last_clientIP.toString();
 
             JsonObject ddpJ = json.createNestedObject("ddp");
             ddpJ["num_packets"] = (String)ddp.stats.packetsReceived;
-            ddpJ["seq_errors"] = (String)ddp.stats.errors;
+            ddpJ["seq_errors"] = (String)ingest.getStats(IngestSrc::DDP)->seq_errors;
             ddpJ["num_bytes"] = (String)ddp.stats.bytesReceived;
             ddpJ["max_channel"] = (String)ddp.stats.ddpMaxChannel;
             ddpJ["min_channel"] = (String)ddp.stats.ddpMinChannel;
 
+            // Ingest stats, side by side for each protocol
+            JsonObject ingestJ = json.createNestedObject("ingest");
+            static const char * const src_names[] = { "e131", "ddp", "zcpp" };
+            for (uint8_t i = 0; i < static_cast<uint8_t>(IngestSrc::COUNT); i++) {
+                const ingest_stats_t *st = ingest.getStats(IngestSrc(i));
+                JsonObject srcJ = ingestJ.createNestedObject(src_names[i]);
+                srcJ["packets"] = (String)st->packets;
+                srcJ["channels"] = (String)st->channels;
+                srcJ["frames"] = (String)st->frames;
+                srcJ["seq_errors"] = (String)st->seq_errors;
+                srcJ["lost"] = (String)st->lost;
+                srcJ["clipped"] = (String)st->clipped;
+            }
+
             // WNRF stats
             JsonObject nrf = json.createNestedObject("nrf");
             if (config.nrf_chan==NrfChan::NRFCHAN_LEGACY) {
@@ -125,6 +140,12 @@ void procX(uint8_t *data, AsyncWebSocketClient *client) {
                uint8_t tempChan = 70+((static_cast<uint8_t>(config.nrf_chan)-1)*2);
                nrf["chan"] = "2.4"+String(tempChan)+" Mhz";
             }
+            if (config.nrf_auto != NRF_AUTOCHAN_OFF) {
+               // Cleanest channel found by the auto channel scoring
+               uint8_t bestId = static_cast<uint8_t>(out_driver.bestChan());
+               uint8_t bestChan = bestId ? 68+(bestId*2) : 80;
+               nrf["best"] = "2.4"+String(bestChan)+" Mhz";
+            }
             if  (config.nrf_baud == NrfBaud::BAUD_2Mbps) {
                nrf["baud"] = "2 Mbps";
             } else {
@@ -194,40 +215,68 @@ void broadcast(String message) {
 
 
 //
-// 'D1' = Device List Push to client
+// 'D1' = Device List Push to client. A 'D1' request gets the whole registry,
+// after that only the devices with an event (new, changed, gone) are pushed.
+// Sent a few devices per message to keep the JSON small.
 //
-void cb_devlist(tDeviceInfo * dev_list, uint8_t count) {
-   // Count is the number of rows in the dev_list table
-   // Dont' want to generate the JSON more than once.. so should we be
-   // maintaining the context list here vs in the WnrfDriver??
-   if (count) {
-      DynamicJsonDocument json(1024);
+#define DEVLIST_CHUNK 8
+
+static const char * const dev_events[] = { "seen", "new", "changed", "gone" };
+
+void sendDevices(const tDeviceEntry * dev_list, uint16_t count, AsyncWebSocketClient *client) {
+   uint16_t i = 0;
+   char tempid[8];
+
+   while (i < count) {
+      DynamicJsonDocument json(4096);
       JsonObject devList = json.createNestedObject("deviceList");
-      char tempid[8];
+      uint8_t rows = 0;
 
-      while (count--) {
-         tDeviceInfo *dev = &(dev_list[count]);
+      for (; (i<count) && (rows<DEVLIST_CHUNK); i++) {
+         const tDeviceEntry *dev = &(dev_list[i]);
+         if (!client && !dev->event) continue; // Unchanged
 
-         id2txt(tempid, dev->dev_id);
-         // Convert 3-byte address into a HEX string
-         /*char *bytes = (char *)&(dev->dev_id);
-         sprintf(tempid,"%2.2X%2.2X%2.2X",bytes[2],bytes[1],bytes[0]); */
+         id2txt(tempid, dev->info.dev_id);
          JsonObject device = devList.createNestedObject(tempid);
-            device["dev_id"]= tempid;    // Device Id
-            device["type"]  = dev->type; // Device Type
-            device["blv"]   = dev->blv;  // Boot Loader Version
-            device["apm"]   = dev->apm;  // App Magic Number
-            device["apv"]   = dev->apv;  // Boot Loader Version
-            device["start"] = dev->start;// E1.31 start Address
-      } // While
+            device["dev_id"]= tempid;           // Device Id
+            device["type"]  = dev->info.type;   // Device Type
+            device["blv"]   = dev->info.blv;    // Boot Loader Version
+            device["apm"]   = dev->info.apm;    // App Magic Number
+            device["apv"]   = dev->info.apv;    // App Version
+            device["start"] = dev->info.start;  // E1.31 start Address
+            device["event"] = dev_events[dev->event];
+            device["link"]  = out_driver.replyRate(dev);  // % of beacons answered
+            device["rpd"]   = dev->replies ? (dev->strong*100)/dev->replies : 0;
+            device["age"]   = (millis() - dev->last_seen)/1000;
+            if (dev->loss != NRF_LOSS_UNKNOWN) {         // Client telemetry
+               device["loss"]   = dev->loss;               // % packets lost
+               device["missed"] = dev->frames_missed;
+               device["short"]  = dev->frames_short;
+               device["crc"]    = dev->crc_errors;
+               JsonArray hist = device.createNestedArray("hist"); // Oldest first
+               for (uint8_t h=0; h<NRF_LOSS_HISTORY; h++) {
+                  uint8_t loss = dev->loss_hist[(dev->loss_next+h) % NRF_LOSS_HISTORY];
+                  if (loss != NRF_LOSS_UNKNOWN) hist.add(loss);
+               }
+            }
+         rows++;
+      }
+      if (!rows) break;
 
       // Prepare JSON for transmission
       String message;
       serializeJson(devList, message);
+      if (client) {
+         client->text("D1"+message);
+      } else {
+         // Broadcast this to all web clients devices
+         broadcast("D1"+message);
+      }
+   }
+}
 
-      // Broadcast this to all web clients devices
-      broadcast("D1"+message);
-   } // if result>0
+void cb_devlist(const tDeviceEntry * dev_list, uint16_t count) {
+   sendDevices(dev_list, count, NULL);
 }
 
 
@@ -297,8 +346,11 @@ void procD(uint8_t *data, AsyncWebSocketClient *client) {
               sendEditResponse(data[1],false,client);
            }
            break; // Turn on the Streaming Output
-        case '1':
-            LOG_PORT.println(F("(D1) Device Refresh Request**"));
+        case '1': {
+               uint16_t count;
+               const tDeviceEntry *devs = out_driver.getDevices(&count);
+               sendDevices(devs, count, client);
+            }
             break;
         case '2': {
                LOG_PORT.println(F("(D2) CHANNEL update request**"));
@@ -328,7 +380,10 @@ void procD(uint8_t *data, AsyncWebSocketClient *client) {
                   if (params.containsKey("devid")) {
                      // Parse the string to a device id
                      tempid = txt2id(params["devid"].as<const char*>());
-                     int retcode = out_driver.nrf_flash(tempid, fw_name, client);
+                     // HEX uploaded by an older release, convert it now
+                     if (!SPIFFS.exists(LHE_IMAGE_FILE))
+                        buildFWImage();
+                     int retcode = out_driver.nrf_flash(tempid, LHE_IMAGE_FILE, client);
 
                      if (retcode)
                         cb_flash(tempid, client, retcode);
@@ -341,6 +396,24 @@ void procD(uint8_t *data, AsyncWebSocketClient *client) {
                }
             }
             break;
+        case '6': { // Broadcast OTA to every device of a type/apm
+               int retcode = -11;
+
+               if (ws_edit_client==client) {
+                  if (!SPIFFS.exists(LHE_IMAGE_FILE))
+                     buildFWImage();
+                  retcode = out_driver.nrf_fleetflash(params["type"], params["apm"], LHE_IMAGE_FILE, client);
+               }
+               // Devices taking part, each then reports a D4 result
+               DynamicJsonDocument json(256);
+               JsonObject fleet = json.createNestedObject("fleet");
+               fleet["result"] = retcode;
+
+               String message;
+               serializeJson(fleet, message);
+               client->text("D6" + message);
+            }
+            break;
         default : // Do Nothing
             break;
     }
@@ -423,6 +496,17 @@ void procG(uint8_t *data, AsyncWebSocketClient *client) {
 //LOG_PORT.print(response);
             break;
         }
+
+#if defined(ESPS_MODE_WNRF)
+        case '4': {
+            String response;
+            serializeRadioStats(response);
+            if (data[2] == 'R')
+                out_driver.resetStats();
+            client->text("G4" + response);
+            break;
+        }
+#endif
     }
 }
 
@@ -536,8 +620,9 @@ void procV(uint8_t *data, AsyncWebSocketClient *client) {
             break;
            }
 #if defined(ESPS_MODE_WNRF)
-	case '2': { // View Frequency Histogram
-            client->binary(out_driver.getNrfHistogram(),84);
+	case '2': { // View Frequency Histogram - cached, scanned in the background
+            client->binary(out_driver.getNrfHistogram(),NRF_SCAN_CHANNELS);
+            break;
            }
 #endif
     }
@@ -757,6 +842,13 @@ void wsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
      }
   }
 
+  // Auto channel moved the clients and the controller, remember it
+  void cb_autochan(NrfChan chanid) {
+     LOG_PORT.print(F("* Auto channel moved to "));
+     LOG_PORT.println(static_cast<uint8_t>(chanid));
+     config.nrf_chan = chanid;
+     writeConfig(); // The driver is already there, no restart
+  }
 
   void register_nrf_callbacks () {
      out_driver.nrf_async_otaflash = cb_flash;
@@ -765,6 +857,7 @@ void wsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client,
      out_driver.nrf_async_startaddr= cb_startaddr;
 
      out_driver.nrf_async_devlist  = cb_devlist;
+     out_driver.nrf_async_autochan = cb_autochan;
   }
 #endif /*WNRF*/
 #endif /* ESPIXELSTICK_H_ */